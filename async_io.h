@@ -0,0 +1,574 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Read-ahead input and write-behind output, so that solving sentences does
+// not wait on storage.
+//
+// A file is read or written in large buffers, several of which are in flight
+// at once: AsyncInputBuffer keeps reading the buffers ahead of the one being
+// parsed, and AsyncOutputBuffer writes a full buffer in the background while
+// the next one is filled. The reads and writes are submitted to io_uring
+// (through the raw system calls, so that no library is needed) when the
+// kernel supports it, and run on a worker thread otherwise.
+//
+
+#ifndef NLU_CRF_ASYNC_IO_H__
+#define NLU_CRF_ASYNC_IO_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define NLU_CRF_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+namespace nlu {
+
+struct AsyncIoOptions {
+  // buffers in flight per file, and their size in bytes
+  int num_buffers;
+  size_t buffer_size;
+  // use io_uring when available, rather than a worker thread
+  bool io_uring;
+
+  AsyncIoOptions() : num_buffers(4), buffer_size(1 << 20), io_uring(true) {}
+};
+
+
+// Reads and writes of a file at given offsets, completing in the background.
+// Every operation is identified by a tag in [0, num_tags), which may have at
+// most one operation in flight.
+class AsyncFile {
+ public:
+  AsyncFile(int file_descriptor, int num_tags, bool use_io_uring)
+    : fd(file_descriptor), iovecs(num_tags), results(num_tags, 0),
+      pending(num_tags, false), stopping(false) {
+#ifdef NLU_CRF_HAS_IO_URING
+    ring_fd = -1;
+    unsubmitted = 0;
+    if (use_io_uring) {
+      setupRing(2 * num_tags);
+    }
+    if (ring_fd >= 0) {
+      return;
+    }
+#endif
+    worker = std::thread(&AsyncFile::run, this);
+  }
+
+  ~AsyncFile() {
+    for (size_t tag = 0; tag < pending.size(); tag++) {
+      Wait(tag);
+    }
+#ifdef NLU_CRF_HAS_IO_URING
+    if (ring_fd >= 0) {
+      munmap(sqes, sqes_size);
+      if (cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+      }
+      munmap(sq_ring, sq_ring_size);
+      close(ring_fd);
+      return;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    queued.notify_all();
+    worker.join();
+  }
+
+  bool UsesIoUring() const {
+#ifdef NLU_CRF_HAS_IO_URING
+    return ring_fd >= 0;
+#else
+    return false;
+#endif
+  }
+
+  // start reading (or writing) len bytes at offset into (from) buf
+  void Submit(int tag, bool write, char* buf, size_t len, off_t offset) {
+    iovecs[tag].iov_base = buf;
+    iovecs[tag].iov_len = len;
+#ifdef NLU_CRF_HAS_IO_URING
+    if (ring_fd >= 0) {
+      pending[tag] = true;
+      submitToRing(tag, write, offset);
+      return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(mutex);
+    pending[tag] = true;
+    jobs.push_back(Job(tag, write, offset));
+    queued.notify_one();
+  }
+
+  // Wait for the operation of tag, and return the number of bytes it read
+  // or wrote, or -errno. Without an operation in flight, return the result
+  // of the last one.
+  ssize_t Wait(int tag) {
+#ifdef NLU_CRF_HAS_IO_URING
+    if (ring_fd >= 0) {
+      while (pending[tag]) {
+        reapFromRing();
+      }
+      return results[tag];
+    }
+#endif
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending[tag]) {
+      completed.wait(lock);
+    }
+    return results[tag];
+  }
+
+ private:
+  struct Job {
+    int tag;
+    bool write;
+    off_t offset;
+
+    Job(int t, bool w, off_t o) : tag(t), write(w), offset(o) {}
+  };
+
+  // the worker thread, running the jobs in the order they were submitted
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      while (jobs.empty() && !stopping) {
+        queued.wait(lock);
+      }
+      if (jobs.empty()) {
+        return;
+      }
+      Job job = jobs.front();
+      jobs.pop_front();
+      lock.unlock();
+      const struct iovec& iov = iovecs[job.tag];
+      ssize_t n = job.write
+          ? pwrite(fd, iov.iov_base, iov.iov_len, job.offset)
+          : pread(fd, iov.iov_base, iov.iov_len, job.offset);
+      lock.lock();
+      results[job.tag] = n < 0 ? -errno : n;
+      pending[job.tag] = false;
+      completed.notify_all();
+    }
+  }
+
+#ifdef NLU_CRF_HAS_IO_URING
+  void setupRing(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+      return;
+    }
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes
+                   + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring
+        : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe*>(
+        mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+      // give up on io_uring, leaving the worker thread to do the job
+      if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+      }
+      if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+      }
+      if (sq_ring != MAP_FAILED) {
+        munmap(sq_ring, sq_ring_size);
+      }
+      close(ring_fd);
+      ring_fd = -1;
+      return;
+    }
+    char* sq = static_cast<char*>(sq_ring);
+    char* cq = static_cast<char*>(cq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  // At most one operation per tag is in flight, and the ring has room for
+  // two per tag, so the submission queue never overflows.
+  void submitToRing(int tag, bool write, off_t offset) {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<unsigned long>(&iovecs[tag]);
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+    enterRing(0);
+  }
+
+  // Submit the entries the kernel has not taken yet, and wait for
+  // min_complete completions. Entries refused with EAGAIN or EBUSY are
+  // submitted again by the next call; on any other error, they are taken
+  // back from the ring and run synchronously.
+  void enterRing(unsigned min_complete) {
+    while (true) {
+      int n = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, min_complete,
+                      min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (n >= 0) {
+        unsubmitted -= std::min(static_cast<unsigned>(n), unsubmitted);
+        return;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EBUSY) {
+        runUnsubmitted();
+      }
+      return;
+    }
+  }
+
+  // run the entries between the kernel's head and our tail with pread and
+  // pwrite, and remove them from the ring
+  void runUnsubmitted() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail;
+    for (unsigned i = head; i != tail; i++) {
+      const struct io_uring_sqe& sqe = sqes[sq_array[i & sq_mask]];
+      int tag = sqe.user_data;
+      const struct iovec& iov = iovecs[tag];
+      ssize_t n = sqe.opcode == IORING_OP_WRITEV
+          ? pwrite(fd, iov.iov_base, iov.iov_len, sqe.off)
+          : pread(fd, iov.iov_base, iov.iov_len, sqe.off);
+      results[tag] = n < 0 ? -errno : n;
+      pending[tag] = false;
+    }
+    __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+    unsubmitted = 0;
+  }
+
+  // wait for a completion, unless the entries left are run synchronously,
+  // and record all available ones
+  void reapFromRing() {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      enterRing(1);
+    }
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+      results[cqe.user_data] = cqe.res;
+      pending[cqe.user_data] = false;
+      head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  int ring_fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  // entries added to the submission queue which the kernel did not take yet
+  unsigned unsubmitted;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+#endif
+
+  int fd;
+  std::vector<struct iovec> iovecs;
+  std::vector<ssize_t> results;
+  std::vector<bool> pending;
+  // the worker thread and its queue, when io_uring is not used
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable completed;
+  std::deque<Job> jobs;
+  bool stopping;
+};
+
+
+// A streambuf reading a file with num_buffers reads ahead in flight, e.g.
+//
+//   AsyncInputBuffer buffer(path, options);
+//   std::istream fin(&buffer);
+class AsyncInputBuffer : public std::streambuf {
+ public:
+  AsyncInputBuffer(const std::string& path, const AsyncIoOptions& options)
+    : fd(open(path.c_str(), O_RDONLY)), buffer_size(options.buffer_size),
+      buffers(std::max(options.num_buffers, 1)), offsets(buffers.size(), 0),
+      next_offset(0), current(-1), at_end(false) {
+    if (fd < 0) {
+      return;
+    }
+    file.reset(new AsyncFile(fd, buffers.size(), options.io_uring));
+    for (size_t b = 0; b < buffers.size(); b++) {
+      buffers[b].resize(buffer_size);
+      readAhead(b);
+    }
+  }
+
+  ~AsyncInputBuffer() {
+    file.reset();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool is_open() const {
+    return fd >= 0;
+  }
+
+  bool UsesIoUring() const {
+    return file && file->UsesIoUring();
+  }
+
+  // empty unless a read failed, in which case the stream ends before the
+  // buffer which could not be read
+  std::string Error() const {
+    return error;
+  }
+
+ protected:
+  int_type underflow() {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+    if (fd < 0 || at_end) {
+      return traits_type::eof();
+    }
+    if (current >= 0) {
+      // the buffer just consumed reads further ahead
+      readAhead(current);
+    }
+    current = (current + 1) % buffers.size();
+    ssize_t n = file->Wait(current);
+    // a short read before the end of the file is completed synchronously,
+    // as the buffers after it were read at the following offsets
+    while (n > 0 && static_cast<size_t>(n) < buffer_size) {
+      ssize_t m = pread(fd, &buffers[current][n], buffer_size - n,
+                        offsets[current] + n);
+      if (m < 0) {
+        n = -errno;
+      }
+      if (m <= 0) {
+        break;
+      }
+      n += m;
+    }
+    if (n < 0) {
+      error = strerror(-n);
+    }
+    if (n <= 0) {
+      at_end = true;
+      return traits_type::eof();
+    }
+    char* begin = &buffers[current][0];
+    setg(begin, begin, begin + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+ private:
+  void readAhead(int b) {
+    offsets[b] = next_offset;
+    next_offset += buffer_size;
+    file->Submit(b, false, &buffers[b][0], buffer_size, offsets[b]);
+  }
+
+  int fd;
+  size_t buffer_size;
+  std::vector<std::vector<char> > buffers;
+  std::vector<off_t> offsets;
+  off_t next_offset;
+  int current;
+  bool at_end;
+  std::string error;
+  std::unique_ptr<AsyncFile> file;
+};
+
+
+// A streambuf writing a file in the background: a full buffer is written
+// while the next one is filled, with up to num_buffers writes in flight.
+// Use OpenAsyncOutputFile to write to it with fprintf.
+class AsyncOutputBuffer : public std::streambuf {
+ public:
+  AsyncOutputBuffer(const std::string& path, const AsyncIoOptions& options)
+    : fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+      buffer_size(options.buffer_size),
+      buffers(std::max(options.num_buffers, 1)),
+      lengths(buffers.size(), 0), offsets(buffers.size(), 0),
+      next_offset(0), current(0), failed(false) {
+    if (fd < 0) {
+      return;
+    }
+    file.reset(new AsyncFile(fd, buffers.size(), options.io_uring));
+    for (size_t b = 0; b < buffers.size(); b++) {
+      buffers[b].resize(buffer_size);
+    }
+    setp(&buffers[0][0], &buffers[0][0] + buffer_size);
+  }
+
+  ~AsyncOutputBuffer() {
+    sync();
+    file.reset();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool is_open() const {
+    return fd >= 0;
+  }
+
+  bool UsesIoUring() const {
+    return file && file->UsesIoUring();
+  }
+
+ protected:
+  int_type overflow(int_type c) {
+    if (fd < 0) {
+      return traits_type::eof();
+    }
+    writeBehind();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  // write what is buffered and wait for every write
+  int sync() {
+    if (fd < 0) {
+      return -1;
+    }
+    writeBehind();
+    for (size_t b = 0; b < buffers.size(); b++) {
+      complete(b);
+    }
+    return failed ? -1 : 0;
+  }
+
+ private:
+  // start writing the current buffer, and move to the next one once its
+  // previous write completed
+  void writeBehind() {
+    size_t length = pptr() - pbase();
+    if (length == 0) {
+      return;
+    }
+    lengths[current] = length;
+    offsets[current] = next_offset;
+    next_offset += length;
+    file->Submit(current, true, &buffers[current][0], length,
+                 offsets[current]);
+    current = (current + 1) % buffers.size();
+    complete(current);
+    setp(&buffers[current][0], &buffers[current][0] + buffer_size);
+  }
+
+  // wait for the write of buffer b, finishing a short write synchronously
+  void complete(int b) {
+    if (lengths[b] == 0) {
+      return;
+    }
+    ssize_t n = file->Wait(b);
+    while (n >= 0 && static_cast<size_t>(n) < lengths[b]) {
+      ssize_t m = pwrite(fd, &buffers[b][n], lengths[b] - n, offsets[b] + n);
+      if (m <= 0) {
+        n = -1;
+        break;
+      }
+      n += m;
+    }
+    if (n < 0) {
+      failed = true;
+    }
+    lengths[b] = 0;
+  }
+
+  int fd;
+  size_t buffer_size;
+  std::vector<std::vector<char> > buffers;
+  // bytes in flight of every buffer, 0 when it is free
+  std::vector<size_t> lengths;
+  std::vector<off_t> offsets;
+  off_t next_offset;
+  int current;
+  bool failed;
+  std::unique_ptr<AsyncFile> file;
+};
+
+
+inline ssize_t WriteAsyncOutput(void* cookie, const char* buf, size_t size) {
+  return static_cast<AsyncOutputBuffer*>(cookie)->sputn(buf, size);
+}
+
+inline int CloseAsyncOutput(void* cookie) {
+  return static_cast<AsyncOutputBuffer*>(cookie)->pubsync();
+}
+
+// A FILE writing to buffer, which must outlive it; fclose waits for every
+// write.
+inline FILE* OpenAsyncOutputFile(AsyncOutputBuffer* buffer) {
+  cookie_io_functions_t functions;
+  memset(&functions, 0, sizeof(functions));
+  functions.write = WriteAsyncOutput;
+  functions.close = CloseAsyncOutput;
+  return fopencookie(buffer, "w", functions);
+}
+
+} // namespace nlu
+
+#endif
@@ -0,0 +1,176 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Expected governors of one forest under K sets of edge merits at once.
+//
+// The structural work of updateGovernorGivenChild (deciding the markup of the
+// parent, resolving its headword and finding it in the parent cell) does not
+// depend on the merits, so it is done once per markup, and every markup
+// carries a K-wide vector of probabilities which is updated by a single
+// contiguous multiply-add loop.
+//
+
+#ifndef NLU_CRF_BATCHED_GOVERNOR_H__
+#define NLU_CRF_BATCHED_GOVERNOR_H__
+
+#include <string>
+#include <vector>
+
+#include "expected_governor.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+struct BatchedGovernorCell {
+  // the probability field of the markups is not used
+  std::vector<GovernorMarkup> gms;
+  // probability of markup i under merit set k at i * K + k
+  std::vector<float> probabilities;
+};
+
+
+class BatchedGovernorFinder {
+ public:
+  // merits[k][j] is the merit of edge j in the k-th set of merits, in the
+  // same log space as HyperEdgeInfo::merit
+  BatchedGovernorFinder(const ForestSentence* forestSentence,
+                        const std::vector<std::vector<float> >& merits)
+    : fs(forestSentence), num_of_sets(static_cast<int>(merits.size())) {
+    const ParseForest& forest = fs->forest();
+    int K = num_of_sets;
+    // edge-major merits, so that the K weights of an edge are contiguous
+    edge_weights.resize(static_cast<size_t>(forest.edges_size()) * K);
+    for (int k = 0; k < K; k++) {
+      for (int j = 0; j < forest.edges_size(); j++) {
+        edge_weights[static_cast<size_t>(j) * K + k] =
+            ProbabilitySemiring::FromLogMerit(merits[k][j]);
+      }
+    }
+    headwords.resize(forest.nodes_size());
+    for (int i = 0; i < forest.nodes_size(); i++) {
+      const NodeInfo& node = forest.nodes(i);
+      for (int j = node.headword_stt(); j < node.headword_end(); j++) {
+        headwords[i] += fs->tokens(j);
+      }
+    }
+
+    governors.assign(forest.nodes_size(),
+                     std::vector<BatchedGovernorCell>(fs->basic_units_size()));
+    for (int i = 0; i < forest.nodes_size(); i++) {
+      const NodeInfo& node = forest.nodes(i);
+      if (node.basic_unit() == 1 && node.upper() == 0) {
+        int bu_idx = -1;
+        for (int j = 0; j < fs->basic_units_size(); j++) {
+          if (fs->basic_units(j).start() == node.start()
+              && fs->basic_units(j).end() == node.end()) {
+            bu_idx = j;
+            break;
+          }
+        }
+        governors[i][bu_idx].gms.push_back(GovernorMarkup());
+        governors[i][bu_idx].probabilities.assign(K, 1.0);
+      }
+    }
+
+    for (int i = 0; i < forest.nodes_size(); i++) {
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        const float* weights = &edge_weights[static_cast<size_t>(j) * K];
+        for (int c = 0; c < edge.tail_idx_size(); c++) {
+          for (int k = 0; k < fs->basic_units_size(); k++) {
+            updateGovernorGivenChild(i, edge.tail_idx(c), k,
+                                     edge.tail_idx_size() == 2, weights);
+          }
+        }
+      }
+
+      for (int j = 0; j < fs->basic_units_size(); j++) {
+        BatchedGovernorCell& cell = governors[i][j];
+        for (int k = 0; k < K; k++) {
+          float sum = 0.0;
+          for (size_t m = 0; m < cell.gms.size(); m++) {
+            sum += cell.probabilities[m * K + k];
+          }
+          if (sum <= 0.0) {
+            // as in ProbabilitySemiring::Normalize, zeros rather than NaN
+            continue;
+          }
+          for (size_t m = 0; m < cell.gms.size(); m++) {
+            cell.probabilities[m * K + k] /= sum;
+          }
+        }
+      }
+    }
+  }
+
+  // same as GovernorFinder::updateGovernorGivenChild, with K weights
+  void updateGovernorGivenChild(int pidx, int cidx, int bu_idx,
+                                bool binary_rule, const float* weights) {
+    const NodeInfo& parent = fs->forest().nodes(pidx);
+    const NodeInfo& child = fs->forest().nodes(cidx);
+    const BatchedGovernorCell& child_cell = governors[cidx][bu_idx];
+    BatchedGovernorCell& parent_cell = governors[pidx][bu_idx];
+    int K = num_of_sets;
+    GovernorMarkup m;
+    for (size_t i = 0; i < child_cell.gms.size(); i++) {
+      PropagateMarkup(child, parent, binary_rule, headwords[pidx],
+                      child_cell.gms[i], &m);
+
+      size_t j = 0;
+      while (j < parent_cell.gms.size() && !(m == parent_cell.gms[j])) {
+        j++;
+      }
+      if (j == parent_cell.gms.size()) {
+        parent_cell.gms.push_back(m);
+        parent_cell.probabilities.resize(parent_cell.gms.size() * K, 0.0);
+      }
+      float* p = &parent_cell.probabilities[j * K];
+      const float* q = &child_cell.probabilities[i * K];
+      for (int k = 0; k < K; k++) {
+        p[k] += q[k] * weights[k];
+      }
+    }
+  }
+
+  int NumOfSets() const {
+    return num_of_sets;
+  }
+
+  // governors of node i under the k-th set of merits
+  std::vector<GovernorsPerWord> GetGovernors(int i, int k) const {
+    std::vector<GovernorsPerWord> result(governors[i].size());
+    for (size_t j = 0; j < governors[i].size(); j++) {
+      const BatchedGovernorCell& cell = governors[i][j];
+      result[j].idx = j;
+      result[j].gms = cell.gms;
+      for (size_t m = 0; m < cell.gms.size(); m++) {
+        result[j].gms[m].probability = cell.probabilities[m * num_of_sets + k];
+      }
+    }
+    return result;
+  }
+
+  // governors of the top node under every set of merits
+  std::vector<std::vector<GovernorsPerWord> > GetTopGovernors() const {
+    std::vector<std::vector<GovernorsPerWord> > result;
+    for (int k = 0; k < num_of_sets; k++) {
+      result.push_back(GetGovernors(fs->forest().nodes_size() - 1, k));
+    }
+    return result;
+  }
+
+ private:
+  const ForestSentence* fs;
+  int num_of_sets;
+  std::vector<float> edge_weights;
+  std::vector<std::string> headwords;
+  // the first dimension indicates idx of node, and the second dimension
+  // indicates idx of basic unit
+  std::vector<std::vector<BatchedGovernorCell> > governors;
+};
+
+} // namespace nlu
+
+#endif
@@ -0,0 +1,393 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Governors along a single derivation of a parse forest, and the max-product
+// (Viterbi) counterpart of GovernorFinder built on it.
+//
+// GovernorFinder normalizes every cell, so a hyper edge effectively has
+// probability merit / (sum of merits of the edges of its head), and a
+// derivation is weighted by the product of these. When the spans of the
+// basic units do not overlap and the tails of every edge split the span of
+// its head, every derivation of a node covers the same basic units, each
+// exactly once, so the best markup of every cell of a node comes from the
+// same best derivation: one backpointer per node is enough to recover the
+// best markup of all its cells.
+//
+
+#ifndef NLU_CRF_BEST_DERIVATION_H__
+#define NLU_CRF_BEST_DERIVATION_H__
+
+#include <math.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "expected_governor.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+// Index of the basic unit a leaf node stands for (the first basic unit with
+// the same span, as in GovernorFinder), or -1 if the node is not a leaf.
+inline int LeafBasicUnit(const ForestSentence& fs, const NodeInfo& node) {
+  if (node.basic_unit() != 1 || node.upper() != 0) {
+    return -1;
+  }
+  for (int j = 0; j < fs.basic_units_size(); j++) {
+    if (fs.basic_units(j).start() == node.start()
+        && fs.basic_units(j).end() == node.end()) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+// Whether the distinct spans of the basic units do not overlap.
+inline bool DisjointBasicUnits(const ForestSentence& fs) {
+  std::vector<std::pair<int, int> > spans;
+  for (int j = 0; j < fs.basic_units_size(); j++) {
+    spans.push_back(std::make_pair(fs.basic_units(j).start(),
+                                   fs.basic_units(j).end()));
+  }
+  std::sort(spans.begin(), spans.end());
+  spans.erase(std::unique(spans.begin(), spans.end()), spans.end());
+  for (size_t j = 1; j < spans.size(); j++) {
+    if (spans[j-1].second > spans[j].first) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether the tails of an edge split the span of its head.
+inline bool SplitsSpan(const ParseForest& forest, const NodeInfo& node,
+                       const HyperEdgeInfo& edge) {
+  const NodeInfo& first = forest.nodes(edge.tail_idx(0));
+  const NodeInfo& last = forest.nodes(edge.tail_idx(edge.tail_idx_size()-1));
+  if (first.start() != node.start() || last.end() != node.end()) {
+    return false;
+  }
+  return edge.tail_idx_size() == 1 || first.end() == last.start();
+}
+
+// Governor markup of every basic unit in the derivation of the top node which
+// expands node i with edge derivation_edge[i] (-1 for leaves). Each reached
+// basic unit gets one markup, the others none. The result is the same as
+// GovernorFinder on the forest restricted to the derivation, in time linear
+// in the size of the derivation, with the rule of DecidesGovernor:
+//  - bottom up, a basic unit whose governor is not known yet gets it at the
+//    lowest binary edge where its node is not the head child;
+//  - a unary edge changing the headword (like START_SYMBOL -> S) overrides
+//    the governors of every basic unit below it, so top down the highest
+//    such edge wins.
+// The buffers are sized for the forest once and only the entries of the
+// nodes and basic units of a derivation are reset, so that reading many
+// derivations of a forest allocates nothing per derivation.
+class DerivationGovernorReader {
+ public:
+  explicit DerivationGovernorReader(const ForestSentence* forestSentence)
+    : fs(forestSentence), markups(fs->basic_units_size()),
+      known(fs->basic_units_size(), false),
+      unknown(fs->forest().nodes_size()),
+      override_of(fs->forest().nodes_size(), -1) {}
+
+  // the (basic unit, markup) of every basic unit reached by the derivation,
+  // in the order of its leaves
+  void Read(const std::vector<int>& derivation_edge,
+            std::vector<std::pair<int, GovernorMarkup> >* governors) {
+    const ParseForest& forest = fs->forest();
+    governors->clear();
+    if (forest.nodes_size() == 0) {
+      return;
+    }
+    int top = forest.nodes_size() - 1;
+
+    // nodes of the derivation, parents before children
+    order.clear();
+    stack.assign(1, top);
+    while (!stack.empty()) {
+      int i = stack.back();
+      stack.pop_back();
+      order.push_back(i);
+      unknown[i].clear();
+      override_of[i] = -1;
+      if (derivation_edge[i] < 0) {
+        continue;
+      }
+      const HyperEdgeInfo& edge = forest.edges(derivation_edge[i]);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        stack.push_back(edge.tail_idx(k));
+      }
+    }
+    leaves.clear();
+    for (size_t o = 0; o < order.size(); o++) {
+      int bu_idx = derivation_edge[order[o]] < 0
+                   ? LeafBasicUnit(*fs, forest.nodes(order[o])) : -1;
+      if (bu_idx >= 0) {
+        markups[bu_idx] = GovernorMarkup();
+        known[bu_idx] = false;
+      }
+    }
+
+    // bottom up: basic units whose governor is not known yet at each node
+    for (int o = static_cast<int>(order.size()) - 1; o >= 0; o--) {
+      int i = order[o];
+      const NodeInfo& parent = forest.nodes(i);
+      if (derivation_edge[i] < 0) {
+        int bu_idx = LeafBasicUnit(*fs, parent);
+        if (bu_idx >= 0) {
+          unknown[i].push_back(bu_idx);
+          leaves.push_back(i);
+        }
+        continue;
+      }
+      const HyperEdgeInfo& edge = forest.edges(derivation_edge[i]);
+      bool binary_rule = edge.tail_idx_size() == 2;
+      std::string headword;
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        int c = edge.tail_idx(k);
+        const NodeInfo& child = forest.nodes(c);
+        if (!DecidesGovernor(child, parent, binary_rule,
+                             LABEL_NOT_KNOWN_YET)) {
+          unknown[i].insert(unknown[i].end(), unknown[c].begin(),
+                            unknown[c].end());
+        } else if (binary_rule) {
+          if (headword.empty()) {
+            headword = HeadwordOf(*fs, parent);
+          }
+          for (size_t u = 0; u < unknown[c].size(); u++) {
+            PropagateMarkup(child, parent, binary_rule, headword,
+                            GovernorMarkup(), &markups[unknown[c][u]]);
+            known[unknown[c][u]] = true;
+          }
+        }
+        // a unary edge changing the headword is applied top down below
+        unknown[c].clear();
+      }
+    }
+
+    // top down: the highest unary edge changing the headword overrides
+    for (size_t o = 0; o < order.size(); o++) {
+      int i = order[o];
+      if (derivation_edge[i] < 0) {
+        continue;
+      }
+      const HyperEdgeInfo& edge = forest.edges(derivation_edge[i]);
+      int override_node = override_of[i];
+      // a unary edge decides the governor whatever the markup below
+      if (override_node < 0 && edge.tail_idx_size() == 1
+          && DecidesGovernor(forest.nodes(edge.tail_idx(0)), forest.nodes(i),
+                             false, LABEL_NOT_KNOWN_YET)) {
+        override_node = i;
+      }
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        override_of[edge.tail_idx(k)] = override_node;
+      }
+    }
+
+    for (size_t l = 0; l < leaves.size(); l++) {
+      int bu_idx = LeafBasicUnit(*fs, forest.nodes(leaves[l]));
+      GovernorMarkup m = markups[bu_idx];
+      int override_node = override_of[leaves[l]];
+      if (override_node >= 0) {
+        const NodeInfo& parent = forest.nodes(override_node);
+        const HyperEdgeInfo& edge =
+            forest.edges(derivation_edge[override_node]);
+        PropagateMarkup(forest.nodes(edge.tail_idx(0)), parent, false,
+                        HeadwordOf(*fs, parent), m, &m);
+      } else if (!known[bu_idx]) {
+        // the headword of the top node keeps the initial markup
+        m = GovernorMarkup();
+      }
+      governors->push_back(std::make_pair(bu_idx, m));
+    }
+  }
+
+ private:
+  const ForestSentence* fs;
+  std::vector<GovernorMarkup> markups;
+  std::vector<bool> known;
+  std::vector<std::vector<int> > unknown;
+  std::vector<int> override_of;
+  std::vector<int> order;
+  std::vector<int> stack;
+  std::vector<int> leaves;
+};
+
+// Governors of the top node along a single derivation, see
+// DerivationGovernorReader, every markup with the given probability.
+inline std::vector<GovernorsPerWord> DerivationGovernors(
+    const ForestSentence& fs, const std::vector<int>& derivation_edge,
+    float probability = 1.0) {
+  std::vector<GovernorsPerWord> result(fs.basic_units_size());
+  for (int j = 0; j < fs.basic_units_size(); j++) {
+    result[j].idx = j;
+  }
+  std::vector<std::pair<int, GovernorMarkup> > governors;
+  DerivationGovernorReader(&fs).Read(derivation_edge, &governors);
+  for (size_t g = 0; g < governors.size(); g++) {
+    governors[g].second.probability = probability;
+    result[governors[g].first].gms.push_back(governors[g].second);
+  }
+  return result;
+}
+
+
+// Whether the top node has a single derivation as GovernorFinder sees it:
+// every node below it has exactly one edge (leaves none) with a positive
+// merit, whose tails are leaves or nodes computed before it, and no node is
+// reached twice. If so, derivation_edge gets the edge of
+// every node of the derivation (-1 for the others), and DerivationGovernors
+// with probability 1 is the result of GovernorFinder, as every cell of the
+// chart holds at most one markup. Stops at the first ambiguous node, so that
+// ambiguous forests are rejected early.
+inline bool SingleDerivation(const ForestSentence& fs,
+                             std::vector<int>* derivation_edge) {
+  const ParseForest& forest = fs.forest();
+  int num_of_nodes = forest.nodes_size();
+  derivation_edge->assign(num_of_nodes, -1);
+  if (num_of_nodes == 0 || forest.starting_indexes_size() <= num_of_nodes) {
+    return false;
+  }
+  std::vector<bool> visited(num_of_nodes, false);
+  std::vector<int> stack(1, num_of_nodes - 1);
+  visited[num_of_nodes - 1] = true;
+  while (!stack.empty()) {
+    int i = stack.back();
+    stack.pop_back();
+    int num_of_edges =
+        forest.starting_indexes(i+1) - forest.starting_indexes(i);
+    if (LeafBasicUnit(fs, forest.nodes(i)) >= 0) {
+      if (num_of_edges != 0) {
+        return false;
+      }
+      continue;
+    }
+    int j = forest.starting_indexes(i);
+    if (num_of_edges != 1 || EdgeProbability(forest.edges(j)) <= 0.0) {
+      return false;
+    }
+    const HyperEdgeInfo& edge = forest.edges(j);
+    (*derivation_edge)[i] = j;
+    for (int k = 0; k < edge.tail_idx_size(); k++) {
+      int t = edge.tail_idx(k);
+      if (t >= i && LeafBasicUnit(fs, forest.nodes(t)) < 0) {
+        return false;
+      }
+      // a node shared within the derivation would be counted twice
+      if (visited[t]) {
+        return false;
+      }
+      visited[t] = true;
+      stack.push_back(t);
+    }
+  }
+  return true;
+}
+
+
+// Max-product pass over the forest: every node keeps the log probability of
+// its best derivation and a backpointer to the edge it came from. exact()
+// tells whether the forest qualifies for a single backpointer per node, see
+// above.
+class ViterbiGovernorFinder {
+ public:
+  explicit ViterbiGovernorFinder(const ForestSentence* forestSentence)
+    : fs(forestSentence), is_exact(DisjointBasicUnits(*forestSentence)) {
+    const ParseForest& forest = fs->forest();
+    int num_of_nodes = forest.nodes_size();
+    best_edge.assign(num_of_nodes, -1);
+    best_score.assign(num_of_nodes, -std::numeric_limits<double>::infinity());
+
+    for (int i = 0; i < num_of_nodes; i++) {
+      if (LeafBasicUnit(*fs, forest.nodes(i)) >= 0) {
+        best_score[i] = 0.0;
+        continue;
+      }
+      // edges whose tails have no derivation contribute nothing to the
+      // cells of GovernorFinder, so they are left out of the normalization,
+      // a log-sum-exp of the log merits shifted by their maximum
+      double max = -std::numeric_limits<double>::infinity();
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        if (hasDerivation(forest.edges(j))) {
+          max = std::max(max, static_cast<double>(forest.edges(j).merit()));
+        }
+      }
+      double sum = 0.0;
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        if (hasDerivation(forest.edges(j))) {
+          sum += exp(forest.edges(j).merit() - max);
+        }
+      }
+      double log_sum = max + log(sum);
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        if (!hasDerivation(edge) || std::isinf(log_sum)
+            || edge.merit() == -std::numeric_limits<float>::infinity()) {
+          continue;
+        }
+        if (!SplitsSpan(forest, forest.nodes(i), edge)) {
+          is_exact = false;
+        }
+        double score = edge.merit() - log_sum;
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          score += best_score[edge.tail_idx(k)];
+        }
+        if (best_edge[i] < 0 || score > best_score[i]) {
+          best_edge[i] = j;
+          best_score[i] = score;
+        }
+      }
+    }
+  }
+
+  // whether the best markup of every cell comes from the best derivation of
+  // its node, so that GetGovernors() is the best markup of every basic unit
+  bool exact() const {
+    return is_exact;
+  }
+
+  // best governor markup of every basic unit of the top node, with the
+  // probability of the best derivation
+  std::vector<GovernorsPerWord> GetGovernors() const {
+    return DerivationGovernors(*fs, best_edge,
+                               static_cast<float>(exp(BestScore())));
+  }
+
+  // log probability of the best derivation of the top node
+  double BestScore() const {
+    return best_score.empty() ? 0.0 : best_score.back();
+  }
+
+  // winning edge of every node, -1 for leaves and nodes without derivation
+  const std::vector<int>& BestEdges() const {
+    return best_edge;
+  }
+
+ private:
+  bool hasDerivation(const HyperEdgeInfo& edge) const {
+    for (int k = 0; k < edge.tail_idx_size(); k++) {
+      if (std::isinf(best_score[edge.tail_idx(k)])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const ForestSentence* fs;
+  bool is_exact;
+  std::vector<int> best_edge;
+  std::vector<double> best_score;
+};
+
+} // namespace nlu
+
+#endif
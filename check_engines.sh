@@ -0,0 +1,300 @@
+#!/bin/sh
+# Copyright MISingularity.io
+# All right reserved.
+
+#
+# Run find_expected_governor on data/tcrf.predict with every engine and
+# compare its output with the one of the dense GovernorFinder, e.g.
+#
+#   bazel build :find_expected_governor
+#   ./check_engines.sh bazel-bin/find_expected_governor
+#
+# Exit with the number of engines which failed.
+#
+
+binary=${1:-bazel-bin/find_expected_governor}
+binary=$(cd "$(dirname "$binary")" && pwd)/$(basename "$binary")
+root=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+mkdir "$work/data"
+cp "$root/data/tcrf_rule" "$root/data/binary_headrules" "$work/data"
+cp "$root/data/tcrf.predict" "$work/data/tcrf_predict"
+failures=0
+
+fail() {
+  echo "FAIL $1: $2"
+  failures=$((failures + 1))
+}
+
+# run NAME FLAGS...: run the binary with FLAGS, keeping its output in
+# $work/NAME
+run() {
+  name=$1
+  shift
+  (cd "$work" && "$binary" "$@" > "$work/$name.log" 2>&1)
+  status=$?
+  if [ $status -ne 0 ]; then
+    fail "$name" "exit status $status"
+    cat "$work/$name.log"
+    return 1
+  fi
+  cp "$work/data/tcrf_expected_governor" "$work/$name"
+}
+
+# same NAME FLAGS...: the output with FLAGS must be the dense output
+same() {
+  run "$@" || return
+  if cmp -s "$work/dense" "$work/$1"; then
+    echo "ok   $1"
+  else
+    fail "$1" "differs from the dense output"
+    diff "$work/dense" "$work/$1" | head -20
+  fi
+}
+
+# canonical OUTPUT: every line of OUTPUT prefixed with its sentence and basic
+# unit, sorted, so that the order of the markups of a basic unit does not
+# matter
+canonical() {
+  awk '
+    units == 0 && left == 0 {
+      sentence++
+      unit = 0
+      units = $1
+      print sentence, 0, $1
+      next
+    }
+    left == 0 {
+      unit++
+      units--
+      left = $3
+      print sentence, unit, "unit", $0
+      next
+    }
+    {
+      left--
+      print sentence, unit, $0
+    }' "$1" | LC_ALL=C sort
+}
+
+# close NAME TOLERANCE FLAGS...: the output with FLAGS must be the dense
+# output, up to the order of the markups of a basic unit and to
+# probabilities at most TOLERANCE apart
+close() {
+  name=$1
+  tolerance=$2
+  shift 2
+  run "$name" "$@" || return
+  canonical "$work/dense" > "$work/dense.canonical"
+  canonical "$work/$name" > "$work/$name.canonical"
+  if awk -v tolerance="$tolerance" '
+      NR == FNR {
+        expected[FNR] = $0
+        lines = FNR
+        next
+      }
+      {
+        n = split(expected[FNR], e, " ")
+        same = n == NF
+        for (i = 1; same && i <= n; i++) {
+          if (e[i] == $i) {
+            continue
+          }
+          d = e[i] - $i
+          same = e[i] ~ /^[0-9.e+-]+$/ && $i ~ /^[0-9.e+-]+$/ \
+                 && d <= tolerance && -d <= tolerance
+        }
+        if (!same && different++ < 20) {
+          print "< " expected[FNR]
+          print "> " $0
+        }
+      }
+      END {
+        exit different > 0 || FNR != lines
+      }' "$work/dense.canonical" "$work/$name.canonical"; then
+    echo "ok   $name"
+  else
+    fail "$name" "differs from the dense output"
+  fi
+}
+
+run dense || exit 1
+if [ ! -s "$work/dense" ]; then
+  fail dense "empty output"
+fi
+
+same bu_threads --bu_threads=4
+close adaptive 1e-5 --adaptive --adaptive_small_cells=0 --bu_threads=4
+same spill --spill_path="$work/spill"
+same cache --cache_mb=16
+close share_cells 1e-5 --share_cells
+close share_cells_threads 1e-5 --share_cells --bu_threads=4
+same budgets --time_budget_ms=600000 --max_markups=1000000000
+same max_chart_mb --max_chart_mb=4096
+close edge_posteriors 1e-5 --edge_posteriors
+same fast_unambiguous --fast_unambiguous
+same streaming --streaming
+if ! grep -q "streaming: 0 sentences recomputed" "$work/streaming.log"; then
+  fail streaming_recomputed "sentences computed again by GovernorFinder"
+fi
+same simplify_forest --simplify_forest
+close collapse_unary 1e-5 --collapse_unary
+same reorder_forest --reorder_forest
+close log_semiring 1e-5 --semiring=log
+
+# the forest passes under the other semirings, against their own dense output
+for semiring in log max_product; do
+  run dense_$semiring --semiring=$semiring || continue
+  cp "$work/dense" "$work/dense_probability"
+  cp "$work/dense_$semiring" "$work/dense"
+  close simplify_forest_$semiring 1e-5 --semiring=$semiring --simplify_forest
+  close collapse_unary_$semiring 1e-5 --semiring=$semiring --collapse_unary
+  same reorder_forest_$semiring --semiring=$semiring --reorder_forest
+  cp "$work/dense_probability" "$work/dense"
+done
+same async_io --async_io
+same async_io_threads --async_io --io_threads --io_buffers=2 \
+  --io_buffer_kb=1
+
+# the same input compressed with gzip, in two concatenated members
+head -c 4096 "$root/data/tcrf.predict" | gzip -c > "$work/data/tcrf_predict"
+tail -c +4097 "$root/data/tcrf.predict" | gzip -c >> "$work/data/tcrf_predict"
+same gzip
+same gzip_async_io --async_io --io_buffers=2 --io_buffer_kb=1
+cp "$root/data/tcrf.predict" "$work/data/tcrf_predict"
+
+# an input which can not be read (here a directory) must fail the run rather
+# than end it early
+rm "$work/data/tcrf_predict"
+mkdir "$work/data/tcrf_predict"
+for io in uring threads; do
+  flags=--async_io
+  if [ $io = threads ]; then
+    flags="--async_io --io_threads"
+  fi
+  (cd "$work" && "$binary" $flags > /dev/null 2>&1)
+  if [ $? -eq 1 ]; then
+    echo "ok   async_io_read_error_$io"
+  else
+    fail async_io_read_error_$io "read error not reported"
+  fi
+done
+rmdir "$work/data/tcrf_predict"
+cp "$root/data/tcrf.predict" "$work/data/tcrf_predict"
+
+# the table of --aggregate_output must be the sums of the markups of the dense
+# output over all sentences, up to the rounding of the printed probabilities
+if (cd "$work" && "$binary" --aggregate_output="$work/aggregate" \
+      > "$work/aggregate.log" 2>&1); then
+  if awk '
+      NR == FNR {
+        if (NF == 4) {
+          expected[$1 " " $2 " " $3] += $4
+        }
+        next
+      }
+      {
+        key = $1 " " $2 " " $3
+        d = expected[key] - $4
+        if (!(key in expected) || d > 1e-4 || -d > 1e-4) {
+          print "> " $0
+          different++
+        }
+        delete expected[key]
+      }
+      END {
+        for (key in expected) {
+          print "< " key " " expected[key]
+          different++
+        }
+        exit different > 0
+      }' "$work/dense" "$work/aggregate"; then
+    echo "ok   aggregate"
+  else
+    fail aggregate "differs from the sums of the dense output"
+  fi
+else
+  fail aggregate "exit status $?"
+  cat "$work/aggregate.log"
+fi
+
+# approximations of the dense output, which only have to run here;
+# expected_governor_test checks them where they are exact
+for engine in "sampled --samples=1000" "viterbi --viterbi"; do
+  if run $engine; then
+    echo "ok   ${engine%% *}"
+  fi
+done
+
+# slow sentence files which can not be opened must be refused with a
+# message, not a crash
+(cd "$work" && "$binary" --slow_sentence_ms=0 \
+   --slow_sentence_path="$work/missing/slow" > /dev/null 2>&1)
+if [ $? -eq 1 ]; then
+  echo "ok   slow_sentence_path"
+else
+  fail slow_sentence_path "unwritable --slow_sentence_path not refused"
+fi
+mkdir "$work/slow.stats"
+(cd "$work" && "$binary" --slow_sentence_ms=0 \
+   --slow_sentence_path="$work/slow" > /dev/null 2>&1)
+if [ $? -eq 1 ]; then
+  echo "ok   slow_sentence_stats"
+else
+  fail slow_sentence_stats "unwritable --slow_sentence_path stats not refused"
+fi
+
+# an edge listed after the edges of later heads is computed with the range
+# it falls in, which streaming must follow: move the first edge of every
+# sentence after the others
+cp "$work/data/tcrf_predict" "$work/grouped_predict"
+awk '
+  state == 0 { print; left = $1; state = left > 0 ? 1 : 2; next }
+  state == 1 { print; if (--left == 0) state = 2; next }
+  state == 2 {
+    print
+    left = $1
+    state = left == -1 ? 0 : left > 0 ? 3 : 4
+    next
+  }
+  state == 3 { print; if (--left == 0) state = 4; next }
+  state == 4 { print; left = $1; n = 0; state = left > 0 ? 5 : 0; next }
+  state == 5 {
+    edges[++n] = $0
+    if (n == left) {
+      for (k = 2; k <= n; k++) {
+        print edges[k]
+      }
+      print edges[1]
+      state = 0
+    }
+  }' "$work/grouped_predict" > "$work/data/tcrf_predict"
+if run ungrouped_dense && run ungrouped_streaming --streaming; then
+  if cmp -s "$work/ungrouped_dense" "$work/ungrouped_streaming"; then
+    echo "ok   streaming_ungrouped"
+  else
+    fail streaming_ungrouped "differs from the dense output"
+  fi
+fi
+cp "$work/grouped_predict" "$work/data/tcrf_predict"
+
+# combinations of flags which must be refused
+if (cd "$work" && "$binary" --aggregate_output="$work/aggregate" \
+      --feature_output="$work/features" > /dev/null 2>&1); then
+  fail aggregate_features "--aggregate_output with --feature_output accepted"
+else
+  echo "ok   aggregate_features"
+fi
+for flag in --viterbi --samples=10 --max_markups=1000 --time_budget_ms=1000 \
+            --max_chart_mb=64 --cache_mb=16; do
+  name=${flag%%=*}
+  name=streaming_${name#--}
+  if (cd "$work" && "$binary" --streaming $flag > /dev/null 2>&1); then
+    fail $name "--streaming with $flag accepted"
+  else
+    echo "ok   $name"
+  fi
+done
+
+exit $failures
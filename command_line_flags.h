@@ -0,0 +1,73 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Minimal command line flags shared by the binaries: --name=value, or --name
+// for a boolean flag which is switched on.
+//
+
+#ifndef NLU_CRF_COMMAND_LINE_FLAGS_H__
+#define NLU_CRF_COMMAND_LINE_FLAGS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+namespace nlu {
+
+typedef std::map<std::string, std::string> CommandLineFlags;
+
+inline CommandLineFlags parse_flags(int argc, char **argv) {
+  CommandLineFlags flags;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0) {
+      fprintf(stderr, "ignoring unknown argument %s\n", argv[i]);
+      continue;
+    }
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos) {
+      flags[arg.substr(2)] = "true";
+    } else {
+      flags[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+  }
+  return flags;
+}
+
+inline bool flag_bool(const CommandLineFlags& flags, const std::string& name) {
+  CommandLineFlags::const_iterator it = flags.find(name);
+  return it != flags.end() && it->second != "false" && it->second != "0";
+}
+
+inline int flag_int(const CommandLineFlags& flags, const std::string& name,
+                    int default_value) {
+  CommandLineFlags::const_iterator it = flags.find(name);
+  return it == flags.end() ? default_value : std::stoi(it->second);
+}
+
+// an unsigned 64-bit flag, e.g. a seed, which an int can not hold
+inline uint64_t flag_uint64(const CommandLineFlags& flags,
+                            const std::string& name, uint64_t default_value) {
+  CommandLineFlags::const_iterator it = flags.find(name);
+  return it == flags.end() ? default_value : std::stoull(it->second);
+}
+
+inline double flag_double(const CommandLineFlags& flags,
+                          const std::string& name, double default_value) {
+  CommandLineFlags::const_iterator it = flags.find(name);
+  return it == flags.end() ? default_value : std::stod(it->second);
+}
+
+inline std::string flag_string(const CommandLineFlags& flags,
+                               const std::string& name,
+                               const std::string& default_value) {
+  CommandLineFlags::const_iterator it = flags.find(name);
+  return it == flags.end() ? default_value : it->second;
+}
+
+} // namespace nlu
+
+#endif
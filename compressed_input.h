@@ -0,0 +1,223 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Reading of compressed prediction files without decompressing them to disk
+// first.
+//
+// GzipInputBuffer inflates a gzip (or zlib) stream on a dedicated thread into
+// a ring of buffers which the parser consumes, so that decompression overlaps
+// with solving sentences. Concatenated gzip members, as written by parallel
+// compressors like pigz, are read one after the other. The compressed bytes
+// come from any streambuf, e.g. an AsyncInputBuffer reading ahead.
+//
+
+#ifndef NLU_CRF_COMPRESSED_INPUT_H__
+#define NLU_CRF_COMPRESSED_INPUT_H__
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_io.h"
+
+namespace nlu {
+
+enum Compression {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_GZIP,
+  COMPRESSION_ZSTD,
+};
+
+// compression of a file, from its magic number
+inline Compression DetectCompression(const std::string& path) {
+  unsigned char magic[4] = {0, 0, 0, 0};
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == NULL) {
+    return COMPRESSION_NONE;
+  }
+  size_t n = fread(magic, 1, sizeof(magic), f);
+  fclose(f);
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return COMPRESSION_GZIP;
+  }
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f
+      && magic[3] == 0xfd) {
+    return COMPRESSION_ZSTD;
+  }
+  return COMPRESSION_NONE;
+}
+
+// A streambuf of the data inflated from source, with up to num_buffers
+// buffers of buffer_size bytes decompressed ahead of the parser, e.g.
+//
+//   std::ifstream file("data/tcrf_predict");
+//   GzipInputBuffer buffer(file.rdbuf(), options);
+//   std::istream fin(&buffer);
+class GzipInputBuffer : public std::streambuf {
+ public:
+  GzipInputBuffer(std::streambuf* compressed, const AsyncIoOptions& options)
+    : source(compressed),
+      buffer_size(std::max<size_t>(options.buffer_size, 1)),
+      buffers(std::max(options.num_buffers, 1)), sizes(buffers.size(), 0),
+      ready(0), current(-1), done(false), stopping(false) {
+    for (size_t b = 0; b < buffers.size(); b++) {
+      buffers[b].resize(buffer_size);
+    }
+    worker = std::thread(&GzipInputBuffer::run, this);
+  }
+
+  ~GzipInputBuffer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    consumed.notify_all();
+    worker.join();
+  }
+
+  // empty unless the compressed data was corrupt or truncated, in which case
+  // the stream ends at the last byte inflated
+  std::string Error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+  }
+
+ protected:
+  int_type underflow() {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (current >= 0) {
+      // the buffer just consumed can be filled again
+      ready--;
+      consumed.notify_one();
+    }
+    while (ready == 0 && !done) {
+      produced.wait(lock);
+    }
+    if (ready == 0) {
+      setg(NULL, NULL, NULL);
+      current = -1;
+      return traits_type::eof();
+    }
+    current = (current + 1) % buffers.size();
+    char* begin = &buffers[current][0];
+    setg(begin, begin, begin + sizes[current]);
+    return traits_type::to_int_type(*gptr());
+  }
+
+ private:
+  // the decompression thread, filling the buffers in turn
+  void run() {
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = Z_NULL;
+    zs.avail_in = 0;
+    // 15 + 32: the largest window, detecting a gzip or zlib header
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+      finish("can not initialize zlib");
+      return;
+    }
+    std::vector<char> in(buffer_size);
+    // whether part of a gzip member was read, so that the end of the input
+    // there means the data was truncated
+    bool in_member = false;
+    bool end_of_input = false;
+    std::string status;
+    for (size_t b = 0; ; b = (b + 1) % buffers.size()) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (ready == static_cast<int>(buffers.size()) && !stopping) {
+          consumed.wait(lock);
+        }
+        if (stopping) {
+          break;
+        }
+      }
+      zs.next_out = reinterpret_cast<Bytef*>(&buffers[b][0]);
+      zs.avail_out = buffer_size;
+      while (zs.avail_out > 0 && status.empty()) {
+        if (zs.avail_in == 0) {
+          std::streamsize n = source->sgetn(&in[0], in.size());
+          if (n <= 0) {
+            end_of_input = true;
+            if (in_member) {
+              status = "truncated gzip data";
+            }
+            break;
+          }
+          zs.next_in = reinterpret_cast<Bytef*>(&in[0]);
+          zs.avail_in = n;
+        }
+        in_member = true;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+          // another member may follow
+          inflateReset(&zs);
+          in_member = false;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+          status = zs.msg != NULL ? zs.msg : "corrupt gzip data";
+        }
+      }
+      size_t size = buffer_size - zs.avail_out;
+      bool last = end_of_input || !status.empty();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        sizes[b] = size;
+        if (size > 0) {
+          ready++;
+        }
+        if (last) {
+          done = true;
+          error = status;
+        }
+      }
+      produced.notify_one();
+      if (last) {
+        break;
+      }
+    }
+    inflateEnd(&zs);
+  }
+
+  // end the stream without any more data
+  void finish(const std::string& status) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+      error = status;
+    }
+    produced.notify_one();
+  }
+
+  std::streambuf* source;
+  size_t buffer_size;
+  std::vector<std::vector<char> > buffers;
+  std::vector<size_t> sizes;
+  // buffers inflated and not consumed yet, including the one being parsed
+  int ready;
+  // buffer being parsed, -1 before the first one
+  int current;
+  bool done;
+  bool stopping;
+  std::string error;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable produced;
+  std::condition_variable consumed;
+};
+
+} // namespace nlu
+
+#endif
@@ -0,0 +1,258 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Expected governors of the top node from edge posteriors, in time linear in
+// the size of the forest.
+//
+// GovernorFinder weighs an edge by p(e|h) = merit / (sum of the merits of the
+// edges of h which have a derivation). The governor of a basic unit u is
+// decided by a single edge of a derivation:
+//  - a binary edge whose child c does not share the headword of the head,
+//    where u is the headword of c and its governor is still unknown, i.e. no
+//    unary edge changing the headword lies on the head path from c to u;
+//  - otherwise the highest unary edge changing the headword above u, which
+//    overrides every basic unit below it.
+// So with the "clean" outside probability of every node (of reaching it from
+// the top without a unary edge changing the headword on the way) and, bottom
+// up, the probability that the headword of a node is still unknown, every
+// edge adds its posterior to at most two markups, plus one markup for every
+// basic unit below an overriding unary edge.
+//
+// This equals GovernorFinder when every derivation of a node covers the same
+// basic units, so that the normalization of every cell of the node is the
+// same: the spans of the basic units do not overlap, the tails of an edge
+// split the span of its head, and the tails of an edge either all or none
+// have a derivation when the head is computed. exact() tells whether the
+// forest qualifies. The global NodeInfo::inside_score and outside_score are
+// not used, as they are not normalized per head like GovernorFinder.
+//
+
+#ifndef NLU_CRF_EDGE_POSTERIOR_GOVERNOR_H__
+#define NLU_CRF_EDGE_POSTERIOR_GOVERNOR_H__
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "best_derivation.h"
+#include "expected_governor.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+class EdgePosteriorGovernorFinder {
+ public:
+  explicit EdgePosteriorGovernorFinder(const ForestSentence* forestSentence)
+    : fs(forestSentence), is_exact(true) {
+    result.resize(fs->basic_units_size());
+    for (int j = 0; j < fs->basic_units_size(); j++) {
+      result[j].idx = j;
+    }
+    if (fs->forest().nodes_size() > 0 && indexBasicUnits()) {
+      is_exact = computeInside() && computeOutside();
+    }
+    if (!is_exact) {
+      for (size_t j = 0; j < result.size(); j++) {
+        result[j].gms.clear();
+      }
+    }
+  }
+
+  // whether the result is the same as GovernorFinder's, see above
+  bool exact() const {
+    return is_exact;
+  }
+
+  // governors of every basic unit of the top node, empty if not exact()
+  const std::vector<GovernorsPerWord>& GetGovernors() const {
+    return result;
+  }
+
+ private:
+  // map the spans of the basic units to their index (the first one of a
+  // span, as in GovernorFinder), and check that distinct spans do not overlap
+  bool indexBasicUnits() {
+    for (int j = 0; j < fs->basic_units_size(); j++) {
+      std::pair<int, int> span(fs->basic_units(j).start(),
+                               fs->basic_units(j).end());
+      bu_of_span.insert(std::make_pair(span, j));
+    }
+    is_exact = DisjointBasicUnits(*fs);
+    return is_exact;
+  }
+
+  // basic unit whose span is the headword of node i, or -1
+  int headwordBasicUnit(int i) const {
+    const NodeInfo& node = fs->forest().nodes(i);
+    std::map<std::pair<int, int>, int>::const_iterator it = bu_of_span.find(
+        std::make_pair(node.headword_stt(), node.headword_end()));
+    return it == bu_of_span.end() ? -1 : it->second;
+  }
+
+  // Bottom up, in the order GovernorFinder computes the nodes: which edges
+  // have a derivation, the sum of their merits, and the probability that
+  // the headword of every node is still without governor.
+  bool computeInside() {
+    const ParseForest& forest = fs->forest();
+    int num_of_nodes = forest.nodes_size();
+    is_leaf.assign(num_of_nodes, false);
+    available.assign(num_of_nodes, false);
+    merit_sum.assign(num_of_nodes, 0.0);
+    unknown.assign(num_of_nodes, 0.0);
+    productive.assign(forest.edges_size(), false);
+    for (int i = 0; i < num_of_nodes; i++) {
+      const NodeInfo& node = forest.nodes(i);
+      is_leaf[i] = node.basic_unit() == 1 && node.upper() == 0;
+      if (is_leaf[i]) {
+        // GovernorFinder sets up every leaf before computing any node
+        available[i] = true;
+        unknown[i] = 1.0;
+      }
+    }
+
+    for (int i = 0; i < num_of_nodes; i++) {
+      const NodeInfo& node = forest.nodes(i);
+      int begin = forest.starting_indexes(i);
+      int end = forest.starting_indexes(i+1);
+      if (is_leaf[i]) {
+        if (begin != end) {
+          return false;
+        }
+        continue;
+      }
+      for (int j = begin; j < end; j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        int num_of_available = 0;
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          int t = edge.tail_idx(k);
+          // a tail after its head is not computed yet, unless it is a leaf
+          if (is_leaf[t] || (t < i && available[t])) {
+            num_of_available++;
+          }
+        }
+        if (num_of_available == 0) {
+          continue;
+        }
+        if (num_of_available < edge.tail_idx_size()
+            || !SplitsSpan(forest, node, edge)) {
+          return false;
+        }
+        productive[j] = true;
+        available[i] = true;
+        merit_sum[i] += EdgeProbability(edge);
+      }
+      for (int j = begin; j < end; j++) {
+        if (!productive[j]) {
+          continue;
+        }
+        const HyperEdgeInfo& edge = forest.edges(j);
+        double p = EdgeProbability(edge) / merit_sum[i];
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          int t = edge.tail_idx(k);
+          if (!DecidesGovernor(forest.nodes(t), node,
+                               edge.tail_idx_size() == 2,
+                               LABEL_NOT_KNOWN_YET)) {
+            unknown[i] += p * unknown[t];
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  // Top down: the clean outside probability of every node, and the
+  // posterior of every edge deciding a governor.
+  bool computeOutside() {
+    const ParseForest& forest = fs->forest();
+    int top = forest.nodes_size() - 1;
+    if (!available[top]) {
+      return true;
+    }
+    std::vector<double> outside(forest.nodes_size(), 0.0);
+    outside[top] = 1.0;
+    for (int i = top; i >= 0; i--) {
+      if (is_leaf[i] || outside[i] == 0.0) {
+        continue;
+      }
+      const NodeInfo& node = forest.nodes(i);
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        if (!productive[j]) {
+          continue;
+        }
+        const HyperEdgeInfo& edge = forest.edges(j);
+        double posterior = outside[i] * EdgeProbability(edge) / merit_sum[i];
+        bool binary_rule = edge.tail_idx_size() == 2;
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          int t = edge.tail_idx(k);
+          const NodeInfo& child = forest.nodes(t);
+          if (!DecidesGovernor(child, node, binary_rule,
+                               LABEL_NOT_KNOWN_YET)) {
+            outside[t] += posterior;
+            continue;
+          }
+          GovernorMarkup m;
+          PropagateMarkup(child, node, binary_rule, HeadwordOf(*fs, node),
+                          GovernorMarkup(), &m);
+          if (binary_rule) {
+            // the headword of the child gets its governor here if it is
+            // still unknown
+            outside[t] += posterior;
+            int bu_idx = headwordBasicUnit(t);
+            if (bu_idx < 0) {
+              return false;
+            }
+            addMarkup(bu_idx, m, posterior * unknown[t]);
+          } else {
+            // every basic unit below is overridden, whatever happens there
+            std::map<std::pair<int, int>, int>::const_iterator it =
+                bu_of_span.lower_bound(std::make_pair(child.start(), -1));
+            for (; it != bu_of_span.end() && it->first.first < child.end();
+                 ++it) {
+              addMarkup(it->second, m, posterior);
+            }
+          }
+        }
+      }
+    }
+
+    // the headword of the top node keeps the initial markup
+    int bu_idx = headwordBasicUnit(top);
+    if (bu_idx >= 0) {
+      addMarkup(bu_idx, GovernorMarkup(), unknown[top]);
+    }
+    return true;
+  }
+
+  void addMarkup(int bu_idx, const GovernorMarkup& m, double probability) {
+    if (probability <= 0.0) {
+      return;
+    }
+    std::vector<GovernorMarkup>& gms = result[bu_idx].gms;
+    for (size_t k = 0; k < gms.size(); k++) {
+      if (gms[k] == m) {
+        gms[k].probability += probability;
+        return;
+      }
+    }
+    gms.push_back(m);
+    gms.back().probability = probability;
+  }
+
+  const ForestSentence* fs;
+  bool is_exact;
+  std::map<std::pair<int, int>, int> bu_of_span;
+  std::vector<bool> is_leaf;
+  // whether a node has a derivation when GovernorFinder computes its parents
+  std::vector<bool> available;
+  std::vector<bool> productive;
+  std::vector<double> merit_sum;
+  std::vector<double> unknown;
+  std::vector<GovernorsPerWord> result;
+};
+
+} // namespace nlu
+
+#endif
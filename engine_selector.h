@@ -0,0 +1,211 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Choice of the way governors are computed for each forest, from features
+// which are cheap to read off the forest before any propagation:
+//  - forests with a single derivation are walked along it, whatever their
+//    size, which stops at the first ambiguous node otherwise;
+//  - small charts (nodes x basic units) are fastest with plain GovernorFinder,
+//    any preparation costing more than it saves;
+//  - larger ones first try EdgePosteriorGovernorFinder, linear in the size of
+//    the forest, and fall back to GovernorFinder when it is not exact;
+//  - forests with many unary edges get their headword-keeping unary chains
+//    collapsed first;
+//  - sentences with many basic units split their columns across threads;
+//  - very ambiguous forests (many edges per node) may be given a work budget
+//    after which cells are pruned, which is the only choice changing the
+//    result, and is off unless a budget is set.
+// The thresholds are tunable and printed with the number of sentences and
+// time spent per engine.
+//
+
+#ifndef NLU_CRF_ENGINE_SELECTOR_H__
+#define NLU_CRF_ENGINE_SELECTOR_H__
+
+#include <stdio.h>
+
+#include "expected_governor.h"
+#include "forest_simplifier.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+struct ForestFeatures {
+  int basic_units;
+  int nodes;
+  int edges;
+  double edges_per_node;
+  // share of unary edges among all edges
+  double unary_ratio;
+};
+
+inline ForestFeatures ComputeForestFeatures(const ForestSentence& fs) {
+  const ParseForest& forest = fs.forest();
+  ForestFeatures features;
+  features.basic_units = fs.basic_units_size();
+  features.nodes = forest.nodes_size();
+  features.edges = forest.edges_size();
+  int unary_edges = 0;
+  for (int j = 0; j < forest.edges_size(); j++) {
+    if (forest.edges(j).tail_idx_size() == 1) {
+      unary_edges++;
+    }
+  }
+  int inner_nodes = 0;
+  for (int i = 0; i < forest.nodes_size(); i++) {
+    if (!IsLeafNode(forest.nodes(i))) {
+      inner_nodes++;
+    }
+  }
+  features.edges_per_node =
+      inner_nodes > 0 ? static_cast<double>(features.edges) / inner_nodes : 0;
+  features.unary_ratio =
+      features.edges > 0 ? static_cast<double>(unary_edges) / features.edges
+                         : 0;
+  return features;
+}
+
+struct EngineThresholds {
+  // charts of fewer cells (nodes x basic units) go straight to GovernorFinder
+  long long small_chart_cells;
+  // collapse unary chains when at least this share of the edges is unary
+  double collapse_unary_ratio;
+  // split the columns across num_threads threads from this many basic units
+  int threaded_basic_units;
+  int num_threads;
+  // give GovernorFinder a budget of prune_max_markups child markups from
+  // this many edges per inner node; 0 means never
+  double prune_edges_per_node;
+  long long prune_max_markups;
+
+  EngineThresholds()
+    : small_chart_cells(4096), collapse_unary_ratio(0.3),
+      threaded_basic_units(64), num_threads(1), prune_edges_per_node(0),
+      prune_max_markups(0) {}
+};
+
+struct EnginePlan {
+  bool single_derivation;
+  bool edge_posteriors;
+  bool collapse_unary;
+  // threads of GovernorFinder, 0 to keep the ones of the global options
+  int num_threads;
+  bool prune;
+
+  EnginePlan()
+    : single_derivation(false), edge_posteriors(false),
+      collapse_unary(false), num_threads(0), prune(false) {}
+
+  // the options of GovernorFinder for the sentence, from the global ones
+  GovernorFinderOptions Apply(const GovernorFinderOptions& options,
+                              const EngineThresholds& thresholds) const {
+    GovernorFinderOptions result = options;
+    if (num_threads > 0) {
+      result.num_threads = num_threads;
+    }
+    if (prune) {
+      result.max_markups = thresholds.prune_max_markups;
+    }
+    return result;
+  }
+};
+
+inline EnginePlan SelectEngine(const ForestFeatures& features,
+                               const EngineThresholds& thresholds) {
+  EnginePlan plan;
+  plan.single_derivation = true;
+  if (static_cast<long long>(features.nodes) * features.basic_units
+      < thresholds.small_chart_cells) {
+    return plan;
+  }
+  plan.edge_posteriors = true;
+  plan.collapse_unary =
+      features.unary_ratio >= thresholds.collapse_unary_ratio;
+  if (features.basic_units >= thresholds.threaded_basic_units) {
+    plan.num_threads = thresholds.num_threads;
+  }
+  plan.prune = thresholds.prune_edges_per_node > 0
+               && thresholds.prune_max_markups > 0
+               && features.edges_per_node >= thresholds.prune_edges_per_node;
+  return plan;
+}
+
+// The engine which computed a sentence in the end.
+enum GovernorEngine {
+  ENGINE_DENSE = 0,
+  ENGINE_UNAMBIGUOUS,
+  ENGINE_EDGE_POSTERIORS,
+  ENGINE_COLLAPSED,
+  ENGINE_THREADED,
+  ENGINE_PRUNED,
+  NUM_OF_ENGINES
+};
+
+inline const char* EngineName(GovernorEngine engine) {
+  static const char* const names[NUM_OF_ENGINES] = {
+    "dense", "unambiguous", "edge_posteriors", "collapsed", "threaded", "pruned"
+  };
+  return names[engine];
+}
+
+// Engine of a plan once it is known whether the forest had a single
+// derivation and whether the edge posteriors were exact; a plan combining
+// several choices counts as the first of pruned, threaded and collapsed.
+inline GovernorEngine PlannedEngine(const EnginePlan& plan,
+                                    bool single_derivation,
+                                    bool edge_posteriors_exact) {
+  if (plan.single_derivation && single_derivation) {
+    return ENGINE_UNAMBIGUOUS;
+  }
+  if (plan.edge_posteriors && edge_posteriors_exact) {
+    return ENGINE_EDGE_POSTERIORS;
+  }
+  if (plan.prune) {
+    return ENGINE_PRUNED;
+  }
+  if (plan.num_threads > 1) {
+    return ENGINE_THREADED;
+  }
+  if (plan.collapse_unary) {
+    return ENGINE_COLLAPSED;
+  }
+  return ENGINE_DENSE;
+}
+
+class EngineStats {
+ public:
+  EngineStats() {
+    for (int e = 0; e < NUM_OF_ENGINES; e++) {
+      sentences[e] = 0;
+      ms[e] = 0;
+    }
+  }
+
+  void Add(GovernorEngine engine, double elapsed_ms) {
+    sentences[engine]++;
+    ms[engine] += elapsed_ms;
+  }
+
+  // the thresholds, then one "engine: sentences, ms" entry per engine
+  void Print(FILE* out, const EngineThresholds& thresholds) const {
+    fprintf(out, "adaptive: small_chart_cells=%lld collapse_unary_ratio=%g "
+            "threaded_basic_units=%d threads=%d prune_edges_per_node=%g "
+            "prune_max_markups=%lld\n", thresholds.small_chart_cells,
+            thresholds.collapse_unary_ratio, thresholds.threaded_basic_units,
+            thresholds.num_threads, thresholds.prune_edges_per_node,
+            thresholds.prune_max_markups);
+    for (int e = 0; e < NUM_OF_ENGINES; e++) {
+      fprintf(out, "adaptive: %s %d sentences, %.3f ms\n",
+              EngineName(static_cast<GovernorEngine>(e)), sentences[e], ms[e]);
+    }
+  }
+
+ private:
+  int sentences[NUM_OF_ENGINES];
+  double ms[NUM_OF_ENGINES];
+};
+
+} // namespace nlu
+
+#endif
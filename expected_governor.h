@@ -15,10 +15,22 @@
 #define LABEL_NOT_KNOWN_YET -1
 #define HEADWORD_NOT_KNOWN_YET "TBD"
 
-#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "parse_forest.pb.h"
+#include "spill_file.h"
 
 namespace nlu  {
 
@@ -48,11 +60,628 @@ struct GovernorsPerWord {
   std::vector<GovernorMarkup> gms;
 };
 
+inline bool SameHeadword(const NodeInfo& lhs, const NodeInfo& rhs) {
+  return lhs.headword_stt() == rhs.headword_stt()
+         && lhs.headword_end() == rhs.headword_end();
+}
+
+inline std::string HeadwordOf(const ForestSentence& fs, const NodeInfo& node) {
+  std::string headword = "";
+  for (int j = node.headword_stt(); j < node.headword_end(); j++) {
+    headword += fs.tokens(j);
+  }
+  return headword;
+}
+
+// The markup rule every engine propagates governors with. Through an edge
+// from parent to child, the governor of a basic unit of the child is decided
+// when the headword of the child is not the one of the parent, and either
+// the governor is not known yet (label_parent_of_u of its markup is
+// LABEL_NOT_KNOWN_YET, the basic unit is the headword of the child) or the
+// edge is unary, like START_SYMBOL -> S, and overrides it. Otherwise the
+// markup of the child carries over to the parent.
+inline bool DecidesGovernor(const NodeInfo& child, const NodeInfo& parent,
+                            bool binary_rule, int label_parent_of_u) {
+  return !SameHeadword(child, parent)
+         && (!binary_rule || label_parent_of_u == LABEL_NOT_KNOWN_YET);
+}
+
+// Set m to the markup of the parent for the markup child_m of the child, but
+// for its probability: the decided governor, with parent_headword the
+// headword of the parent, or child_m carried over.
+inline void PropagateMarkup(const NodeInfo& child, const NodeInfo& parent,
+                            bool binary_rule,
+                            const std::string& parent_headword,
+                            const GovernorMarkup& child_m, GovernorMarkup* m) {
+  if (DecidesGovernor(child, parent, binary_rule,
+                      child_m.label_parent_of_u)) {
+    m->label_u = child.label();
+    m->label_parent_of_u = parent.label();
+    m->headword_parent_of_u = parent_headword;
+  } else {
+    *m = child_m;
+  }
+}
+
+
+enum GovernorFinderStatus {
+  GOVERNOR_OK,
+  // a work, time or memory budget was exceeded and cells were pruned
+  GOVERNOR_DEGRADED,
+  // even the pruned chart would not fit in max_bytes, nothing was computed,
+  // or the spilled chart could not be read back
+  GOVERNOR_REJECTED,
+};
+
 
-class GovernorFinder {
+struct GovernorFinderOptions {
+  bool print_debug_info;
+  // Number of threads the basic units are partitioned across. Every basic
+  // unit (column of the governor chart) is computed independently of the
+  // others, so each thread sweeps all nodes for its own contiguous range of
+  // columns without any synchronization.
+  int num_threads;
+  // Work and time budget of a sentence; 0 means unlimited. Work is counted
+  // as child markups processed and split across threads by their share of
+  // columns. Once a budget is exceeded, the finder degrades to keeping only
+  // the degraded_cell_size most probable markups of every cell.
+  long long max_markups;
+  int time_budget_ms;
+  int degraded_cell_size;
+  // Memory budget of the governor chart in bytes; 0 means unlimited. A
+  // sentence whose chart would not fit even with one markup per cell is
+  // rejected up front, otherwise the finder degrades like for the other
+  // budgets once the markups stored so far exceed it.
+  size_t max_bytes;
+  // Spill file of the governor chart; empty means the whole chart stays in
+  // memory. Otherwise the rows of the chart are allocated when first used,
+  // and the row of a node is written to the file and released once the last
+  // node reading it is computed, so that memory only holds the rows still
+  // needed by pending parents. Spilling runs on one thread, and max_bytes
+  // then bounds the rows held in memory instead of rejecting up front.
+  std::string spill_path;
+  // Let a cell which is a scaled copy of a child cell share the markups of
+  // the child cell instead of copying them, e.g. along chains of unary
+  // edges. The weight of such a cell is normalized away without rounding,
+  // so its probabilities may differ from the copied ones in the last bits.
+  // Ignored when spilling.
+  bool share_cells;
+  // Compute nothing in the constructor, for a forest whose edges are still
+  // being read: rows are allocated when first used, each node is computed
+  // with computeNode once its range of edges is read, RecomputeNodes
+  // repairs the nodes an edge read later changes, and ReleaseRow frees the
+  // rows no later node reads, see StreamingGovernorFinderT. The other
+  // options are ignored.
+  bool deferred;
+
+  GovernorFinderOptions()
+    : print_debug_info(false), num_threads(1), max_markups(0),
+      time_budget_ms(0), degraded_cell_size(1), max_bytes(0),
+      share_cells(false), deferred(false) {}
+};
+
+
+// Semirings GovernorFinderT propagates the probability field of the markups
+// in. Edge merits (the log scores as read) are mapped into the semiring with
+// FromLogMerit, Zero() is the weight of an impossible edge, and Normalize
+// rescales a cell so that it sums to One() under Plus; GetGovernors maps the
+// values back with ToProbability. Normalize gives the same cell whatever
+// weight the cell was multiplied by with Times, which lets a cell share the
+// normalized cell it is a scaled copy of.
+
+// Plain probabilities, the original behaviour.
+struct ProbabilitySemiring {
+  static float FromLogMerit(float log_merit) { return exp(log_merit); }
+  static float ToProbability(float value) { return value; }
+  static float Zero() { return 0.0; }
+  static float One() { return 1.0; }
+  static float Times(float lhs, float rhs) { return lhs * rhs; }
+  static float Plus(float lhs, float rhs) { return lhs + rhs; }
+
+  static void Normalize(std::vector<GovernorMarkup>* gms) {
+    float sum = 0.0;
+    for (size_t k = 0; k < gms->size(); k++) {
+      sum += (*gms)[k].probability;
+    }
+    if (sum <= 0.0) {
+      // every derivation underflowed, leave the cell at zero rather than NaN
+      return;
+    }
+    for (size_t k = 0; k < gms->size(); k++) {
+      (*gms)[k].probability /= sum;
+    }
+  }
+};
+
+// Log probabilities, so that neither large merits nor long derivations
+// overflow or underflow the floats: the log merits are used as they are,
+// without going through exp.
+struct LogSemiring {
+  static float FromLogMerit(float log_merit) { return log_merit; }
+  static float ToProbability(float value) { return exp(value); }
+  static float Zero() { return -std::numeric_limits<float>::infinity(); }
+  static float One() { return 0.0; }
+  static float Times(float lhs, float rhs) { return lhs + rhs; }
+  static float Plus(float lhs, float rhs) {
+    if (lhs < rhs) {
+      std::swap(lhs, rhs);
+    }
+    if (std::isinf(rhs)) {
+      return lhs;
+    }
+    return lhs + log1p(exp(rhs - lhs));
+  }
+
+  // subtract the log-sum-exp of the cell, shifted by its maximum
+  static void Normalize(std::vector<GovernorMarkup>* gms) {
+    float max = -std::numeric_limits<float>::infinity();
+    for (size_t k = 0; k < gms->size(); k++) {
+      max = std::max(max, (*gms)[k].probability);
+    }
+    if (std::isinf(max)) {
+      return;
+    }
+    float sum = 0.0;
+    for (size_t k = 0; k < gms->size(); k++) {
+      sum += exp((*gms)[k].probability - max);
+    }
+    float log_sum = max + log(sum);
+    for (size_t k = 0; k < gms->size(); k++) {
+      (*gms)[k].probability -= log_sum;
+    }
+  }
+};
+
+// Max-product: the value of a markup is the weight of the best derivation
+// giving it, relative to the best derivation of the cell.
+struct MaxProductSemiring {
+  static float FromLogMerit(float log_merit) { return exp(log_merit); }
+  static float ToProbability(float value) { return value; }
+  static float Zero() { return 0.0; }
+  static float One() { return 1.0; }
+  static float Times(float lhs, float rhs) { return lhs * rhs; }
+  static float Plus(float lhs, float rhs) { return std::max(lhs, rhs); }
+
+  static void Normalize(std::vector<GovernorMarkup>* gms) {
+    float max = 0.0;
+    for (size_t k = 0; k < gms->size(); k++) {
+      max = std::max(max, (*gms)[k].probability);
+    }
+    if (max <= 0.0) {
+      return;
+    }
+    for (size_t k = 0; k < gms->size(); k++) {
+      (*gms)[k].probability /= max;
+    }
+  }
+};
+
+// Probability of an edge, the exp of its log merit, in double so that only
+// scores below about -745 underflow.
+inline double EdgeProbability(const HyperEdgeInfo& edge) {
+  return exp(static_cast<double>(edge.merit()));
+}
+
+// add the markup m to the cell gms, summing it with Semiring::Plus into the
+// equal markup if there is one
+template <class Semiring>
+inline void AddMarkup(const GovernorMarkup& m,
+                      std::vector<GovernorMarkup>* gms) {
+  for (size_t j = 0; j < gms->size(); j++) {
+    if (m == (*gms)[j]) {
+      (*gms)[j].probability = Semiring::Plus((*gms)[j].probability,
+                                             m.probability);
+      return;
+    }
+  }
+  gms->push_back(m);
+}
+
+
+template <class Semiring>
+class GovernorFinderT {
  public:
-  GovernorFinder(ForestSentence* forestSentence, bool print_debug_info = false) {
+  GovernorFinderT(ForestSentence* forestSentence,
+                  bool print_debug_info = false) {
+    GovernorFinderOptions options;
+    options.print_debug_info = print_debug_info;
+    initialize(forestSentence, options);
+  }
+
+  GovernorFinderT(ForestSentence* forestSentence,
+                  const GovernorFinderOptions& options) {
+    initialize(forestSentence, options);
+  }
+
+  // compute expected governor markup of the basic units in
+  // [bu_begin, bu_end) for every node, using a CKY-like algorithm
+  void computeColumns(int bu_begin, int bu_end) {
+    // a sentence without basic units still sweeps its nodes, on no columns
+    int num_of_basic_units = std::max(1, fs->basic_units_size());
+    long long max_markups = 0;
+    if (finder_options.max_markups > 0) {
+      max_markups = std::max(1LL, finder_options.max_markups
+                                  * (bu_end - bu_begin)
+                                  / num_of_basic_units);
+    }
+    size_t max_bytes = 0;
+    if (finder_options.max_bytes > 0) {
+      // when the rows alone already fill the budget, no markup fits and the
+      // columns degrade from the first node on
+      size_t free_bytes = 0;
+      if (finder_options.max_bytes > chart_bytes) {
+        free_bytes = finder_options.max_bytes - chart_bytes;
+      }
+      max_bytes = std::max<size_t>(1, free_bytes * (bu_end - bu_begin)
+                                      / num_of_basic_units);
+    }
+    long long markups = 0;
+    size_t bytes = 0;
+    bool degraded = false;
+    for (int i = 0; i < fs->forest().nodes_size(); i++) {
+      markups += computeNode(i, bu_begin, bu_end);
+
+      if (degraded) {
+        for (int j = bu_begin; j < bu_end; j++) {
+          pruneCell(i, j, finder_options.degraded_cell_size);
+        }
+        spillRows(i, NULL);
+        continue;
+      }
+      for (int j = bu_begin; j < bu_end; j++) {
+        bytes += cellBytes(i, j);
+      }
+      if ((max_markups > 0 && markups > max_markups)
+          || (max_bytes > 0 && bytes > max_bytes)
+          || (finder_options.time_budget_ms > 0
+              && std::chrono::steady_clock::now() - start_time
+                 > std::chrono::milliseconds(finder_options.time_budget_ms))) {
+        // over budget: prune the cells computed so far, and every cell from
+        // now on, so that the rest of the forest is cheap to propagate
+        degraded = true;
+        for (int n = 0; n <= i; n++) {
+          for (int j = bu_begin; j < bu_end; j++) {
+            pruneCell(n, j, finder_options.degraded_cell_size);
+          }
+        }
+        for (int j = bu_begin; j < bu_end; j++) {
+          degraded_columns[j] = 1;
+        }
+      }
+      spillRows(i, &bytes);
+    }
+  }
+
+  // compute expected governor of the basic units in [bu_begin, bu_end) for
+  // node i from its children, return the number of child markups processed
+  long long computeNode(int i, int bu_begin, int bu_end) {
+    long long markups = 0;
+    ensureRow(i);
+    for (int j = fs->forest().starting_indexes(i);
+         j < fs->forest().starting_indexes(i+1); j++) {
+      // for each hyper edge (rule) expanding node i
+      const HyperEdgeInfo& edge = fs->forest().edges(j);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        ensureRow(edge.tail_idx(k));
+      }
+      float weight = Semiring::FromLogMerit(edge.merit());
+      // a zero weight does not cancel out, the cell must hold the zeros
+      bool shareable = !shared_from.empty() && weight != Semiring::Zero()
+                       && std::isfinite(weight);
+      if (edge.tail_idx_size() == 2) {
+        // binary rule
+        int c1 = edge.tail_idx(0), c2 = edge.tail_idx(1);
+        // left child
+        for (int k = bu_begin; k < bu_end; k++) {
+          markups += updateGovernorGivenChild(i, c1, k, true, weight,
+                                              shareable);
+        }
+        // right child
+        for (int k = bu_begin; k < bu_end; k++) {
+          markups += updateGovernorGivenChild(i, c2, k, true, weight,
+                                              shareable);
+        }
+      }
+      else {
+        // unary Rule
+        int c = edge.tail_idx(0);
+        for (int k = bu_begin; k < bu_end; k++) {
+          markups += updateGovernorGivenChild(i, c, k, false, weight,
+                                              shareable);
+        }
+      }
+    }
+
+    for (int j = bu_begin; j < bu_end; j++) {
+      // normalizing a shared cell would only cancel its pending weight
+      if (!isShared(i, j)) {
+        Semiring::Normalize(&governors[i][j].gms);
+      }
+    }
+    return markups;
+  }
+
+  // keep only the max_size most probable governor markups of a cell, and
+  // release the memory of the others
+  void pruneCell(int nidx, int bu_idx, int max_size) {
+    if (governors[nidx].empty() || isShared(nidx, bu_idx)) {
+      // not allocated yet, or spilled, or the cell shared was pruned before
+      return;
+    }
+    std::vector<GovernorMarkup>& gms = governors[nidx][bu_idx].gms;
+    size_t size = static_cast<size_t>(std::max(max_size, 1));
+    if (gms.size() <= size) {
+      return;
+    }
+    std::partial_sort(gms.begin(), gms.begin() + size, gms.end(),
+                      MoreProbable);
+    std::vector<GovernorMarkup>(gms.begin(), gms.begin() + size).swap(gms);
+    Semiring::Normalize(&gms);
+  }
+
+  // update expected governor of a particular basic unit (identified by bu_idx)
+  // for parent node given one child node, return the number of child markups
+  // processed. If the parent cell is empty and would be a copy of the child
+  // cell scaled by weight, it shares the child cell instead (when shareable),
+  // and is materialized if another child contributes to it.
+  size_t updateGovernorGivenChild(int pidx, int cidx, int bu_idx,
+                                  bool binary_rule, float weight,
+                                  bool shareable) {
+    const NodeInfo& parent = fs->forest().nodes(pidx);
+    const NodeInfo& child = fs->forest().nodes(cidx);
+    const std::vector<GovernorMarkup>& child_gms = cellMarkups(cidx, bu_idx);
+    if (child_gms.empty()) {
+      return 0;
+    }
+    // only the cells of nodes computed before are final
+    if (shareable && cidx < pidx && governors[pidx][bu_idx].gms.empty()
+        && !isShared(pidx, bu_idx)
+        && keepsMarkups(child_gms, child, parent, binary_rule)) {
+      shared_from[pidx][bu_idx] = isShared(cidx, bu_idx)
+                                  ? shared_from[cidx][bu_idx] : cidx;
+      shared_weight[bu_idx] = weight;
+      return child_gms.size();
+    }
+    materialize(pidx, bu_idx);
+    std::vector<GovernorMarkup>& gms = governors[pidx][bu_idx].gms;
+    std::string headword;
+    if (!SameHeadword(child, parent)) {
+      headword = HeadwordOf(*fs, parent);
+    }
+    GovernorMarkup m;
+    for (size_t i = 0; i < child_gms.size(); i++) {
+      PropagateMarkup(child, parent, binary_rule, headword, child_gms[i], &m);
+      m.probability = Semiring::Times(child_gms[i].probability, weight);
+      AddMarkup<Semiring>(m, &gms);
+    }
+    return child_gms.size();
+  }
+
+  // Set the merits of the given (edge index, log merit) pairs and recompute
+  // only the nodes depending on them: the nodes computing the changed edges
+  // and all the nodes reading them, in node order, reusing every other cell.
+  // A finder which was degraded, rejected or spilled is recomputed from
+  // scratch; budgets only apply to such full passes. Return the number of
+  // nodes recomputed.
+  int UpdateEdgeMerits(const std::vector<std::pair<int, float> >& merits) {
+    ParseForest* forest = fs->mutable_forest();
+    for (size_t e = 0; e < merits.size(); e++) {
+      forest->mutable_edges(merits[e].first)->set_merit(merits[e].second);
+    }
+    if (status() != GOVERNOR_OK || spill) {
+      governors.clear();
+      initialize(fs, finder_options);
+      return forest->nodes_size();
+    }
+
+    if (parent_nodes.empty()) {
+      // an edge is computed by the node whose range of edges holds it,
+      // which is not its head_idx for an edge listed after the edges of a
+      // later head; edges after the range of the last node are never
+      // computed
+      parent_nodes.resize(forest->nodes_size());
+      edge_owners.assign(forest->edges_size(), -1);
+      for (int i = 0; i < forest->nodes_size(); i++) {
+        for (int j = forest->starting_indexes(i);
+             j < forest->starting_indexes(i+1); j++) {
+          const HyperEdgeInfo& edge = forest->edges(j);
+          edge_owners[j] = i;
+          for (int k = 0; k < edge.tail_idx_size(); k++) {
+            parent_nodes[edge.tail_idx(k)].push_back(i);
+          }
+        }
+      }
+    }
+    // a node only reads the cells of the nodes before it, but for the
+    // initial cells of the ones after it, so one pass in node order marks
+    // every node reading an affected one
+    std::vector<bool> affected(forest->nodes_size(), false);
+    for (size_t e = 0; e < merits.size(); e++) {
+      if (edge_owners[merits[e].first] >= 0) {
+        affected[edge_owners[merits[e].first]] = true;
+      }
+    }
+    std::vector<int> nodes;
+    for (int i = 0; i < forest->nodes_size(); i++) {
+      if (!affected[i]) {
+        continue;
+      }
+      nodes.push_back(i);
+      for (size_t p = 0; p < parent_nodes[i].size(); p++) {
+        affected[parent_nodes[i][p]] = true;
+      }
+    }
+
+    RecomputeNodes(nodes);
+    return static_cast<int>(nodes.size());
+  }
+
+  // reset the given nodes, in node order, and compute them again from the
+  // current cells of the other nodes
+  void RecomputeNodes(const std::vector<int>& nodes) {
+    for (size_t n = 0; n < nodes.size(); n++) {
+      ensureRow(nodes[n]);
+      resetNode(nodes[n]);
+    }
+    runColumnSweeps([this, &nodes](int bu_begin, int bu_end) {
+      for (size_t n = 0; n < nodes.size(); n++) {
+        computeNode(nodes[n], bu_begin, bu_end);
+      }
+    });
+  }
+
+  // governors of every node, with probabilities mapped out of the semiring;
+  // spilled rows are read back from the spill file, and if that fails the
+  // finder is rejected, leaving these rows without markups
+  std::vector<std::vector<GovernorsPerWord> > GetGovernors() {
+    std::vector<std::vector<GovernorsPerWord> > result = governors;
+    for (size_t i = 0; i < shared_from.size(); i++) {
+      for (size_t j = 0; j < shared_from[i].size(); j++) {
+        if (shared_from[i][j] >= 0) {
+          result[i][j].gms = governors[shared_from[i][j]][j].gms;
+        }
+      }
+    }
+    for (size_t i = 0; spill && i < result.size(); i++) {
+      if (spill_offsets[i] >= 0) {
+        if (!loadRow(spill_offsets[i], &result[i])) {
+          fprintf(stderr, "can not map spill file %s\n",
+                  finder_options.spill_path.c_str());
+          rejected = true;
+        }
+      } else if (result[i].empty()) {
+        // never read: the initial cells of the node
+        allocateRow(i, &result[i]);
+      }
+    }
+    for (size_t i = 0; i < result.size(); i++) {
+      for (size_t j = 0; j < result[i].size(); j++) {
+        for (size_t k = 0; k < result[i][j].gms.size(); k++) {
+          GovernorMarkup& m = result[i][j].gms[k];
+          m.probability = Semiring::ToProbability(m.probability);
+        }
+      }
+    }
+    return result;
+  }
+
+  GovernorFinderStatus status() const {
+    if (rejected) {
+      return GOVERNOR_REJECTED;
+    }
+    for (size_t j = 0; j < degraded_columns.size(); j++) {
+      if (degraded_columns[j]) {
+        return GOVERNOR_DEGRADED;
+      }
+    }
+    return GOVERNOR_OK;
+  }
+
+  // whether a budget was exceeded, so that (some columns of) the result were
+  // computed with pruned cells
+  bool degraded() const {
+    return status() == GOVERNOR_DEGRADED;
+  }
+
+  // Bytes of the chart of a forest with one markup in every cell, which is
+  // the least the finder needs to hold even when degraded.
+  static size_t EstimateMinimumBytes(const ForestSentence& forestSentence) {
+    size_t num_of_nodes = forestSentence.forest().nodes_size();
+    size_t num_of_basic_units = forestSentence.basic_units_size();
+    return num_of_nodes * (sizeof(std::vector<GovernorsPerWord>)
+                           + num_of_basic_units
+                             * (sizeof(GovernorsPerWord)
+                                + sizeof(GovernorMarkup)));
+  }
+
+  // governors of the top node only, which is never spilled
+  std::vector<GovernorsPerWord> GetTopGovernors() const {
+    if (governors.empty()) {
+      return std::vector<GovernorsPerWord>(fs->basic_units_size());
+    }
+    std::vector<GovernorsPerWord> result = governors.back();
+    for (size_t j = 0; j < result.size(); j++) {
+      result[j].gms = cellMarkups(governors.size() - 1, j);
+      for (size_t k = 0; k < result[j].gms.size(); k++) {
+        GovernorMarkup& m = result[j].gms[k];
+        m.probability = Semiring::ToProbability(m.probability);
+      }
+    }
+    return result;
+  }
+
+  // free the row of node i of a deferred finder, which no node computed
+  // from now on may read
+  void ReleaseRow(int i) {
+    std::vector<GovernorsPerWord>().swap(governors[i]);
+  }
+
+  // bytes written to the spill file
+  size_t SpilledBytes() const {
+    return spill ? static_cast<size_t>(spill->size()) : 0;
+  }
+
+  // the largest number of distinct governor markups in a single cell
+  size_t MaxCellSize() const {
+    size_t max_size = spilled_max_cell_size;
+    for (size_t i = 0; i < governors.size(); i++) {
+      for (size_t j = 0; j < governors[i].size(); j++) {
+        max_size = std::max(max_size, governors[i][j].gms.size());
+      }
+    }
+    return max_size;
+  }
+
+ private:
+  void initialize(ForestSentence* forestSentence,
+                  const GovernorFinderOptions& options) {
     fs = forestSentence;
+    finder_options = options;
+    start_time = std::chrono::steady_clock::now();
+    degraded_columns.assign(fs->basic_units_size(), 0);
+    spill.reset();
+    spill_failed = false;
+    spilled_max_cell_size = 0;
+    shared_from.clear();
+    if (finder_options.deferred) {
+      rejected = false;
+      governors.resize(fs->forest().nodes_size());
+      return;
+    }
+    if (!finder_options.spill_path.empty()) {
+      spill.reset(new SpillFile(finder_options.spill_path));
+      if (!spill->is_open()) {
+        fprintf(stderr, "can not open spill file %s, keeping the chart in "
+                "memory\n", finder_options.spill_path.c_str());
+        spill.reset();
+      }
+    }
+    rejected = !spill && finder_options.max_bytes > 0
+               && EstimateMinimumBytes(*fs) > finder_options.max_bytes;
+    if (rejected) {
+      return;
+    }
+    if (spill) {
+      chart_bytes = fs->forest().nodes_size()
+                    * sizeof(std::vector<GovernorsPerWord>);
+      governors.resize(fs->forest().nodes_size());
+      computeLastReaders();
+      runColumnSweeps([this](int bu_begin, int bu_end) {
+        computeColumns(bu_begin, bu_end);
+      });
+      return;
+    }
+    chart_bytes = fs->forest().nodes_size()
+                  * (sizeof(std::vector<GovernorsPerWord>)
+                     + fs->basic_units_size() * sizeof(GovernorsPerWord));
+    if (finder_options.share_cells) {
+      chart_bytes += fs->forest().nodes_size()
+                     * (sizeof(std::vector<int>)
+                        + fs->basic_units_size() * sizeof(int));
+      shared_from.assign(fs->forest().nodes_size(),
+                         std::vector<int>(fs->basic_units_size(), -1));
+      shared_weight.assign(fs->basic_units_size(), Semiring::One());
+    }
     // initialize
     for (int i = 0; i < fs->forest().nodes_size(); i++) {
       std::vector<GovernorsPerWord> v;
@@ -67,58 +696,16 @@ class GovernorFinder {
     for (int i = 0; i < fs->forest().nodes_size(); i++) {
       const NodeInfo& node = fs->forest().nodes(i);
       if (node.basic_unit() == 1 && node.upper() == 0) {
-        int bu_idx = -1;
-        for (int j = 0; j < fs->basic_units_size(); j++) {
-          if (fs->basic_units(j).start() == node.start()
-              && fs->basic_units(j).end() == node.end()) {
-            bu_idx = j;
-            break;
-          }
-        }
-        GovernorMarkup m;
-        governors[i][bu_idx].gms.push_back(m);
+        resetNode(i);
       }
     }
 
-    // compute expected governor markup using a CKY-like algorithm
-    for (int i = 0; i < fs->forest().nodes_size(); i++) {
-      // compute expected governor for node i
-      for (int j = fs->forest().starting_indexes(i);
-           j < fs->forest().starting_indexes(i+1); j++) {
-        // for each hyper edge (rule) expanding node i
-        const HyperEdgeInfo& edge = fs->forest().edges(j);
-        if (edge.tail_idx_size() == 2) {
-          // binary rule
-          int c1 = edge.tail_idx(0), c2 = edge.tail_idx(1);
-          // left child
-          for (int k = 0; k < fs->basic_units_size(); k++) {
-            updateGovernorGivenChild(i, c1, k, true, edge.merit());
-          }
-          // right child
-          for (int k = 0; k < fs->basic_units_size(); k++) {
-            updateGovernorGivenChild(i, c2, k, true, edge.merit());
-          }
-        }
-        else {
-          // unary Rule
-          int c = edge.tail_idx(0);
-          for (int k = 0; k < fs->basic_units_size(); k++) {
-            updateGovernorGivenChild(i, c, k, false, edge.merit());
-          }
-        }
-      }
-
-      for (size_t j = 0; j < governors[i].size(); j++) {
-        float sum = 0.0;
-        for (size_t k = 0; k < governors[i][j].gms.size(); k++) {
-          sum += governors[i][j].gms[k].probability;
-        }
-        for (size_t k = 0; k < governors[i][j].gms.size(); k++) {
-          governors[i][j].gms[k].probability /= sum;
-        }
-      }
+    runColumnSweeps([this](int bu_begin, int bu_end) {
+      computeColumns(bu_begin, bu_end);
+    });
 
-      if (print_debug_info) {
+    if (options.print_debug_info) {
+      for (int i = 0; i < fs->forest().nodes_size(); i++) {
         printf("\n");
         printf("idx=%d: stt=%d end=%d lbl=%d upper=%d head_stt=%d head_end=%d\n",
                i, fs->forest().nodes(i).start(), fs->forest().nodes(i).end(),
@@ -126,11 +713,11 @@ class GovernorFinder {
                fs->forest().nodes(i).headword_stt(),
                fs->forest().nodes(i).headword_end());
         for (size_t j = 0; j < governors[i].size(); j++) {
-          for (size_t k = 0; k < governors[i][j].gms.size(); k++) {
-            printf("%zu: %d %d %s %f\n", j, governors[i][j].gms[k].label_u,
-                   governors[i][j].gms[k].label_parent_of_u,
-                   governors[i][j].gms[k].headword_parent_of_u.c_str(),
-                   governors[i][j].gms[k].probability);
+          const std::vector<GovernorMarkup>& gms = cellMarkups(i, j);
+          for (size_t k = 0; k < gms.size(); k++) {
+            printf("%zu: %d %d %s %f\n", j, gms[k].label_u,
+                   gms[k].label_parent_of_u,
+                   gms[k].headword_parent_of_u.c_str(), gms[k].probability);
           }
         }
         printf("\n");
@@ -138,86 +725,306 @@ class GovernorFinder {
     }
   }
 
-  // update expected governor of a particular basic unit (identified by bu_idx)
-  // for parent node given one child node
-  void updateGovernorGivenChild(int pidx, int cidx, int bu_idx,
-                                bool binary_rule, float weight) {
-    const NodeInfo& parent = fs->forest().nodes(pidx);
-    const NodeInfo& child = fs->forest().nodes(cidx);
-    for (size_t i = 0; i < governors[cidx][bu_idx].gms.size(); i++) {
-      // for each possible governor markup of this position for child node
-      GovernorMarkup m;
-      if (binary_rule) {
-        // binary rule
-        if ((governors[cidx][bu_idx].gms[i].label_parent_of_u == LABEL_NOT_KNOWN_YET)
-           && (child.headword_stt() != parent.headword_stt()
-               || child.headword_end() != parent.headword_end())) {
-          // If the head word of child node is not the head word of parent node,
-          // and the governor of this position for child node is not known yet,
-          // (which means the word of this position is the head word of child
-          // node) get the governor of this position for parent node according
-          // to definition
-          m.label_u = child.label();
-          m.label_parent_of_u = parent.label();
-          m.headword_parent_of_u = "";
-          for (int j = parent.headword_stt(); j < parent.headword_end(); j++) {
-            m.headword_parent_of_u += fs->tokens(j);
-          }
-          m.probability = governors[cidx][bu_idx].gms[i].probability * weight;
+  // Run sweep(bu_begin, bu_end) over the basic units partitioned across
+  // num_threads threads. Thread t owns columns [t*n/T, (t+1)*n/T);
+  // contiguous ranges keep cells written by different threads apart in
+  // memory.
+  void runColumnSweeps(const std::function<void(int, int)>& sweep) {
+    int num_of_basic_units = fs->basic_units_size();
+    int num_threads = std::max(1, std::min(finder_options.num_threads,
+                                           num_of_basic_units));
+    if (spill) {
+      // rows are allocated and released as a whole
+      num_threads = 1;
+    }
+    if (num_threads == 1) {
+      sweep(0, num_of_basic_units);
+      return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads; t++) {
+      threads.push_back(std::thread(
+          sweep, t * num_of_basic_units / num_threads,
+          (t + 1) * num_of_basic_units / num_threads));
+    }
+    sweep(0, num_of_basic_units / num_threads);
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+  }
+
+  // the cells of node i before it is computed: empty, but for the initial
+  // markup of a leaf
+  void allocateRow(int i, std::vector<GovernorsPerWord>* row) const {
+    row->resize(fs->basic_units_size());
+    for (size_t j = 0; j < row->size(); j++) {
+      (*row)[j].idx = j;
+    }
+    const NodeInfo& node = fs->forest().nodes(i);
+    if (node.basic_unit() == 1 && node.upper() == 0) {
+      for (int j = 0; j < fs->basic_units_size(); j++) {
+        if (fs->basic_units(j).start() == node.start()
+            && fs->basic_units(j).end() == node.end()) {
+          GovernorMarkup m;
+          m.probability = Semiring::One();
+          (*row)[j].gms.push_back(m);
+          break;
         }
-        else {
-          // Otherwise, the governor of this position remains the same
-          m = governors[cidx][bu_idx].gms[i];
-          m.probability *= weight;
+      }
+    }
+  }
+
+  // allocate the row of node i on its first use when spilling or deferred
+  void ensureRow(int i) {
+    if (governors[i].empty()
+        && (finder_options.deferred || (spill && spill_offsets[i] < 0))) {
+      allocateRow(i, &governors[i]);
+    }
+  }
+
+  // Node after which the row of every node is no longer used: the node
+  // itself, or the last node reading it if that comes later (a leaf is read
+  // before its own turn, an upper node is read before it is computed). An
+  // edge is read by the node whose range of edges holds it, which is not
+  // its head_idx for an edge listed after the edges of a later head. Rows of
+  // nodes nobody reads are released right after they are computed, but for
+  // the top node.
+  void computeLastReaders() {
+    const ParseForest& forest = fs->forest();
+    int num_of_nodes = forest.nodes_size();
+    std::vector<int> last_reader(num_of_nodes);
+    for (int i = 0; i < num_of_nodes; i++) {
+      last_reader[i] = i;
+    }
+    for (int i = 0; i < num_of_nodes; i++) {
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          int t = edge.tail_idx(k);
+          last_reader[t] = std::max(last_reader[t], i);
         }
       }
-      else {
-        // unary rule
-        if (child.headword_stt() != parent.headword_stt()
-            || child.headword_end() != parent.headword_end()) {
-          // Get governor markup for the main verb, when process the topmost
-          // rule, like START_SYMBOL -> S
-          m.label_u = child.label();
-          m.label_parent_of_u = parent.label();
-          m.headword_parent_of_u = "";
-          for (int j = parent.headword_stt(); j < parent.headword_end(); j++) {
-            m.headword_parent_of_u += fs->tokens(j);
-          }
-          m.probability = governors[cidx][bu_idx].gms[i].probability * weight;
+    }
+    released_after.assign(num_of_nodes, std::vector<int>());
+    for (int i = 0; i < num_of_nodes - 1; i++) {
+      released_after[last_reader[i]].push_back(i);
+    }
+    spill_offsets.assign(num_of_nodes, -1);
+  }
+
+  // Write the rows no longer read once node i is computed to the spill file
+  // and release them, taking their markups off bytes. Once a write fails,
+  // e.g. on a full disk, the rows stay in memory.
+  void spillRows(int i, size_t* bytes) {
+    if (!spill || spill_failed) {
+      return;
+    }
+    for (size_t r = 0; r < released_after[i].size(); r++) {
+      int n = released_after[i][r];
+      if (governors[n].empty()) {
+        continue;
+      }
+      // only the markups of computed nodes were counted in bytes
+      const NodeInfo& node = fs->forest().nodes(n);
+      bool leaf = node.basic_unit() == 1 && node.upper() == 0;
+      std::string data;
+      size_t released_bytes = 0;
+      for (size_t j = 0; j < governors[n].size(); j++) {
+        const std::vector<GovernorMarkup>& gms = governors[n][j].gms;
+        if (gms.empty()) {
+          continue;
+        }
+        spilled_max_cell_size = std::max(spilled_max_cell_size, gms.size());
+        appendInt(static_cast<int>(j), &data);
+        appendInt(static_cast<int>(gms.size()), &data);
+        for (size_t k = 0; k < gms.size(); k++) {
+          appendInt(gms[k].label_u, &data);
+          appendInt(gms[k].label_parent_of_u, &data);
+          data.append(reinterpret_cast<const char*>(&gms[k].probability),
+                      sizeof(float));
+          appendInt(static_cast<int>(gms[k].headword_parent_of_u.size()),
+                    &data);
+          data += gms[k].headword_parent_of_u;
         }
-        else {
-          // In normal situation, governor markup just remains the same for
-          // unary rule
-          m = governors[cidx][bu_idx].gms[i];
-          m.probability *= weight;
+        if (!leaf) {
+          released_bytes += cellBytes(n, j);
         }
       }
-      // update governor markup for parent node
-      bool exist = false;
-      for (size_t j = 0; j < governors[pidx][bu_idx].gms.size(); j++) {
-        if (m == governors[pidx][bu_idx].gms[j]) {
-          governors[pidx][bu_idx].gms[j].probability += m.probability;
-          exist = true;
+      appendInt(-1, &data);
+      off_t offset = spill->Append(data);
+      if (offset < 0) {
+        fprintf(stderr, "can not write spill file %s, keeping the rest of "
+                "the chart in memory\n", finder_options.spill_path.c_str());
+        spill_failed = true;
+        return;
+      }
+      spill_offsets[n] = offset;
+      if (bytes != NULL) {
+        *bytes -= std::min(*bytes, released_bytes);
+      }
+      std::vector<GovernorsPerWord>().swap(governors[n]);
+    }
+  }
+
+  // read back a row written by spillRows, return false if the spill file
+  // can not be mapped
+  bool loadRow(off_t offset, std::vector<GovernorsPerWord>* row) {
+    row->resize(fs->basic_units_size());
+    for (size_t j = 0; j < row->size(); j++) {
+      (*row)[j].idx = j;
+    }
+    const char* p = spill->Data(offset);
+    if (p == NULL) {
+      return false;
+    }
+    int j;
+    while ((j = readInt(&p)) >= 0) {
+      std::vector<GovernorMarkup>& gms = (*row)[j].gms;
+      int size = readInt(&p);
+      for (int k = 0; k < size; k++) {
+        GovernorMarkup m;
+        m.label_u = readInt(&p);
+        m.label_parent_of_u = readInt(&p);
+        memcpy(&m.probability, p, sizeof(float));
+        p += sizeof(float);
+        int length = readInt(&p);
+        m.headword_parent_of_u.assign(p, length);
+        p += length;
+        gms.push_back(m);
+      }
+    }
+    return true;
+  }
+
+  static void appendInt(int value, std::string* data) {
+    data->append(reinterpret_cast<const char*>(&value), sizeof(int));
+  }
+
+  static int readInt(const char** p) {
+    int value;
+    memcpy(&value, *p, sizeof(int));
+    *p += sizeof(int);
+    return value;
+  }
+
+  // clear the cells of node i, leaving only the initial markup of a leaf
+  void resetNode(int i) {
+    for (size_t j = 0; j < governors[i].size(); j++) {
+      std::vector<GovernorMarkup>().swap(governors[i][j].gms);
+    }
+    if (!shared_from.empty()) {
+      shared_from[i].assign(shared_from[i].size(), -1);
+    }
+    const NodeInfo& node = fs->forest().nodes(i);
+    if (node.basic_unit() == 1 && node.upper() == 0) {
+      int bu_idx = -1;
+      for (int j = 0; j < fs->basic_units_size(); j++) {
+        if (fs->basic_units(j).start() == node.start()
+            && fs->basic_units(j).end() == node.end()) {
+          bu_idx = j;
           break;
         }
       }
-      if (!exist) {
-        governors[pidx][bu_idx].gms.push_back(m);
+      GovernorMarkup m;
+      m.probability = Semiring::One();
+      governors[i][bu_idx].gms.push_back(m);
+    }
+  }
+
+  // approximate bytes held by the markups of a cell
+  size_t cellBytes(int nidx, int bu_idx) const {
+    const std::vector<GovernorMarkup>& gms = governors[nidx][bu_idx].gms;
+    size_t bytes = gms.capacity() * sizeof(GovernorMarkup);
+    for (size_t k = 0; k < gms.size(); k++) {
+      bytes += gms[k].headword_parent_of_u.size();
+    }
+    return bytes;
+  }
+
+  // whether cell (nidx, bu_idx) shares the cell of another node
+  bool isShared(int nidx, int bu_idx) const {
+    return !shared_from.empty() && shared_from[nidx][bu_idx] >= 0;
+  }
+
+  // the markups of a cell, held by the cell it shares if any
+  const std::vector<GovernorMarkup>& cellMarkups(int nidx, int bu_idx) const {
+    int owner = isShared(nidx, bu_idx) ? shared_from[nidx][bu_idx] : nidx;
+    return governors[owner][bu_idx].gms;
+  }
+
+  // whether updateGovernorGivenChild keeps every markup of a child cell as
+  // is, but for the weight
+  static bool keepsMarkups(const std::vector<GovernorMarkup>& child_gms,
+                           const NodeInfo& child, const NodeInfo& parent,
+                           bool binary_rule) {
+    for (size_t k = 0; k < child_gms.size(); k++) {
+      if (DecidesGovernor(child, parent, binary_rule,
+                          child_gms[k].label_parent_of_u)) {
+        return false;
       }
     }
+    return true;
   }
 
-  std::vector<std::vector<GovernorsPerWord> > GetGovernors() {
-    return governors;
+  // copy the cell shared by cell (nidx, bu_idx) into it, applying the
+  // pending weight, before another child is added to it
+  void materialize(int nidx, int bu_idx) {
+    if (!isShared(nidx, bu_idx)) {
+      return;
+    }
+    std::vector<GovernorMarkup>& gms = governors[nidx][bu_idx].gms;
+    gms = governors[shared_from[nidx][bu_idx]][bu_idx].gms;
+    for (size_t k = 0; k < gms.size(); k++) {
+      gms[k].probability = Semiring::Times(gms[k].probability,
+                                           shared_weight[bu_idx]);
+    }
+    shared_from[nidx][bu_idx] = -1;
+  }
+
+  static bool MoreProbable(const GovernorMarkup& lhs,
+                           const GovernorMarkup& rhs) {
+    return lhs.probability > rhs.probability;
   }
 
- private:
   ForestSentence* fs;
+  GovernorFinderOptions finder_options;
+  std::chrono::steady_clock::time_point start_time;
+  // written by the thread owning the column only
+  std::vector<char> degraded_columns;
+  bool rejected;
+  // bytes of the chart without any markup
+  size_t chart_bytes;
+  // the spill file when options.spill_path is set, the offset of every
+  // spilled row in it (-1 for rows in memory), whether a write failed, the
+  // rows released once each node is computed, and the largest cell spilled
+  std::unique_ptr<SpillFile> spill;
+  std::vector<off_t> spill_offsets;
+  bool spill_failed;
+  std::vector<std::vector<int> > released_after;
+  size_t spilled_max_cell_size;
+  // nodes computing the edges each node is a tail of, and the node
+  // computing every edge, built on the first UpdateEdgeMerits
+  std::vector<std::vector<int> > parent_nodes;
+  std::vector<int> edge_owners;
   // the first dimension indicates idx of node, and the second dimension
   // indicates idx of basic unit
   std::vector<std::vector<GovernorsPerWord> > governors;
+  // Copy-on-write cells with options.share_cells, unless spilling: the node
+  // whose cell a cell shares instead of holding its own markups (-1 if
+  // none), always a node whose cell is its own, and the weight pending on
+  // the shared cell of every column of the node being computed. A node whose
+  // only contribution to a cell is a scaled copy of a child cell, e.g. along
+  // a chain of unary edges, or for the basic units of the head child, shares
+  // it, as the weight cancels out when the cell is normalized.
+  std::vector<std::vector<int> > shared_from;
+  std::vector<float> shared_weight;
 };
 
+typedef GovernorFinderT<ProbabilitySemiring> GovernorFinder;
+typedef GovernorFinderT<LogSemiring> LogGovernorFinder;
+typedef GovernorFinderT<MaxProductSemiring> MaxProductGovernorFinder;
+
 } // namespace nlu
 
 #endif
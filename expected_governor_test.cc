@@ -0,0 +1,697 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Checks of the engines only reachable through the library against a full
+// GovernorFinder on data/tcrf.predict, e.g.
+//
+//   bazel test :expected_governor_test
+//
+// Every check prints the sentences it fails on; the test fails if any does.
+//
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "batched_governor.h"
+#include "best_derivation.h"
+#include "edge_posterior_governor.h"
+#include "engine_selector.h"
+#include "expected_governor.h"
+#include "feature_hash.h"
+#include "forest_io.h"
+#include "governor_cache.h"
+#include "governor_counts.h"
+#include "governor_query.h"
+#include "grammar.h"
+#include "parse_forest.pb.h"
+#include "sampled_governor.h"
+
+#define prediction_path "data/tcrf.predict"
+#define rule_path "data/tcrf_rule"
+#define binary_headrules_path "data/binary_headrules"
+
+using namespace nlu;
+
+// whether two cells hold the same markups, in any order, with probabilities
+// at most tolerance apart
+static bool SameCell(const std::vector<GovernorMarkup>& actual,
+                     const std::vector<GovernorMarkup>& expected,
+                     float tolerance) {
+  if (actual.size() != expected.size()) {
+    return false;
+  }
+  for (size_t k = 0; k < actual.size(); k++) {
+    size_t j = 0;
+    while (j < expected.size() && !(actual[k] == expected[j])) {
+      j++;
+    }
+    if (j == expected.size()
+        || !(fabs(actual[k].probability - expected[j].probability)
+             <= tolerance)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// number of cells of actual which are not the ones of expected
+static int CountDifferentCells(
+    const std::vector<std::vector<GovernorsPerWord> >& actual,
+    const std::vector<std::vector<GovernorsPerWord> >& expected,
+    float tolerance) {
+  if (actual.size() != expected.size()) {
+    return 1;
+  }
+  int different = 0;
+  for (size_t i = 0; i < actual.size(); i++) {
+    for (size_t j = 0; j < actual[i].size(); j++) {
+      if (!SameCell(actual[i][j].gms, expected[i][j].gms, tolerance)) {
+        different++;
+      }
+    }
+  }
+  return different;
+}
+
+// Change the merits of every 7th edge a few times in a row and compare the
+// chart of UpdateEdgeMerits with a chart computed from scratch.
+static bool CheckUpdateEdgeMerits(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  GovernorFinder gf(&fs);
+  for (int round = 0; round < 3; round++) {
+    std::vector<std::pair<int, float> > merits;
+    for (int e = round; e < fs.forest().edges_size(); e += 7) {
+      merits.push_back(std::make_pair(
+          e, fs.forest().edges(e).merit() + log(1.5 + round)));
+    }
+    gf.UpdateEdgeMerits(merits);
+    ForestSentence full(fs);
+    GovernorFinder expected(&full);
+    if (CountDifferentCells(gf.GetGovernors(), expected.GetGovernors(),
+                            0.0) > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A memory budget must neither divide by the number of basic units of a
+// sentence without any, nor wrap around when the rows alone exceed it.
+static bool CheckMemoryBudget(const ForestSentence& sentence) {
+  ForestSentence no_basic_units(sentence);
+  no_basic_units.clear_basic_units();
+  for (int i = 0; i < no_basic_units.forest().nodes_size(); i++) {
+    no_basic_units.mutable_forest()->mutable_nodes(i)->set_basic_unit(0);
+  }
+  GovernorFinderOptions options;
+  options.max_bytes = 1 << 30;
+  GovernorFinder gf(&no_basic_units, options);
+  if (gf.status() != GOVERNOR_OK || !gf.GetTopGovernors().empty()) {
+    return false;
+  }
+  ForestSentence fs(sentence);
+  const char* tmpdir = getenv("TEST_TMPDIR");
+  options.spill_path = std::string(tmpdir != NULL ? tmpdir : "/tmp")
+                       + "/expected_governor_test.spill";
+  options.max_bytes = 1;
+  GovernorFinder spilled(&fs, options);
+  return spilled.status() == GOVERNOR_DEGRADED;
+}
+
+// Spill writes failing past the first 4 KB, as on a full disk, must keep the
+// rows in memory rather than lose them.
+static bool CheckSpillWriteFailure(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  GovernorFinderOptions options;
+  const char* tmpdir = getenv("TEST_TMPDIR");
+  options.spill_path = std::string(tmpdir != NULL ? tmpdir : "/tmp")
+                       + "/expected_governor_test.spill";
+  struct rlimit limit;
+  getrlimit(RLIMIT_FSIZE, &limit);
+  struct rlimit small = limit;
+  small.rlim_cur = 4096;
+  void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  setrlimit(RLIMIT_FSIZE, &small);
+  GovernorFinder spilled(&fs, options);
+  setrlimit(RLIMIT_FSIZE, &limit);
+  signal(SIGXFSZ, handler);
+  return spilled.status() == GOVERNOR_OK
+         && CountDifferentCells(spilled.GetGovernors(),
+                                GovernorFinder(&fs).GetGovernors(), 0.0) == 0;
+}
+
+// Every derivation of the top node with its probability, as
+// ViterbiGovernorFinder weighs them, or false if there are more than
+// max_derivations of them.
+static bool EnumerateDerivations(
+    const ForestSentence& fs, const std::vector<double>& edge_probability,
+    std::vector<int>* derivation_edge, std::vector<int> pending,
+    double probability, size_t max_derivations,
+    std::vector<std::pair<double, std::vector<int> > >* derivations) {
+  if (pending.empty()) {
+    derivations->push_back(std::make_pair(probability, *derivation_edge));
+    return derivations->size() <= max_derivations;
+  }
+  int i = pending.back();
+  pending.pop_back();
+  if (LeafBasicUnit(fs, fs.forest().nodes(i)) >= 0) {
+    return EnumerateDerivations(fs, edge_probability, derivation_edge,
+                                pending, probability, max_derivations,
+                                derivations);
+  }
+  for (int j = fs.forest().starting_indexes(i);
+       j < fs.forest().starting_indexes(i+1); j++) {
+    if (edge_probability[j] <= 0.0) {
+      continue;
+    }
+    const HyperEdgeInfo& edge = fs.forest().edges(j);
+    std::vector<int> next = pending;
+    for (int k = 0; k < edge.tail_idx_size(); k++) {
+      next.push_back(edge.tail_idx(k));
+    }
+    (*derivation_edge)[i] = j;
+    if (!EnumerateDerivations(fs, edge_probability, derivation_edge, next,
+                              probability * edge_probability[j],
+                              max_derivations, derivations)) {
+      return false;
+    }
+  }
+  (*derivation_edge)[i] = -1;
+  return true;
+}
+
+// Where ViterbiGovernorFinder is exact, the markup of every basic unit must
+// be its most probable markup over every derivation, found by enumerating
+// the derivations of forests with few of them.
+static bool CheckViterbi(const ForestSentence& fs) {
+  ViterbiGovernorFinder vf(&fs);
+  if (!vf.exact()) {
+    return true;
+  }
+  // the probability of every edge as ViterbiGovernorFinder normalizes it,
+  // 0 for edges without a derivation when their head is computed
+  const ParseForest& forest = fs.forest();
+  std::vector<bool> has_derivation(forest.nodes_size(), false);
+  std::vector<double> edge_probability(forest.edges_size(), 0.0);
+  for (int i = 0; i < forest.nodes_size(); i++) {
+    if (LeafBasicUnit(fs, forest.nodes(i)) >= 0) {
+      has_derivation[i] = true;
+      continue;
+    }
+    double sum = 0.0;
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      bool productive = true;
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        int t = edge.tail_idx(k);
+        productive = productive && has_derivation[t]
+                     && (t < i || LeafBasicUnit(fs, forest.nodes(t)) >= 0);
+      }
+      if (productive) {
+        edge_probability[j] = EdgeProbability(edge);
+        sum += edge_probability[j];
+      }
+    }
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      if (edge_probability[j] > 0.0) {
+        edge_probability[j] /= sum;
+        has_derivation[i] = true;
+      }
+    }
+  }
+  std::vector<int> derivation_edge(forest.nodes_size(), -1);
+  std::vector<std::pair<double, std::vector<int> > > derivations;
+  if (!EnumerateDerivations(fs, edge_probability, &derivation_edge,
+                            std::vector<int>(1, forest.nodes_size() - 1),
+                            1.0, 100000, &derivations)) {
+    return true;
+  }
+  std::vector<GovernorsPerWord> expected(fs.basic_units_size());
+  for (size_t d = 0; d < derivations.size(); d++) {
+    std::vector<GovernorsPerWord> governors = DerivationGovernors(
+        fs, derivations[d].second, derivations[d].first);
+    for (size_t j = 0; j < governors.size(); j++) {
+      if (!governors[j].gms.empty()
+          && (expected[j].gms.empty() || governors[j].gms[0].probability
+                                         > expected[j].gms[0].probability)) {
+        expected[j].gms = governors[j].gms;
+      }
+    }
+  }
+  std::vector<GovernorsPerWord> actual = vf.GetGovernors();
+  for (size_t j = 0; j < actual.size(); j++) {
+    if (!SameCell(actual[j].gms, expected[j].gms, 1e-6)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// None of the forests of data/ has a single derivation, so keep only the
+// edges of the best derivation of every forest, and the walk of
+// DerivationGovernors must give the chart of GovernorFinder on the result.
+// Best derivations reaching a node twice are not single derivations.
+static bool CheckSingleDerivation(const ForestSentence& sentence) {
+  ViterbiGovernorFinder vf(&sentence);
+  const std::vector<int>& best_edge = vf.BestEdges();
+  const ParseForest& forest = sentence.forest();
+  int top = forest.nodes_size() - 1;
+  if (best_edge[top] < 0) {
+    return true;
+  }
+  std::vector<bool> reached(forest.nodes_size(), false);
+  reached[top] = true;
+  for (int i = top; i >= 0; i--) {
+    if (reached[i] && best_edge[i] >= 0) {
+      const HyperEdgeInfo& edge = forest.edges(best_edge[i]);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        reached[edge.tail_idx(k)] = true;
+      }
+    }
+  }
+  ForestSentence fs(sentence);
+  ParseForest* single = fs.mutable_forest();
+  single->clear_edges();
+  single->clear_starting_indexes();
+  for (int i = 0; i < forest.nodes_size(); i++) {
+    single->add_starting_indexes(single->edges_size());
+    if (reached[i] && best_edge[i] >= 0) {
+      *single->add_edges() = forest.edges(best_edge[i]);
+      single->mutable_edges(single->edges_size() - 1)->set_head_idx(i);
+    }
+  }
+  single->add_starting_indexes(single->edges_size());
+  std::vector<int> derivation_edge;
+  if (!SingleDerivation(fs, &derivation_edge)) {
+    return true;
+  }
+  std::vector<std::vector<GovernorsPerWord> > actual(
+      1, DerivationGovernors(fs, derivation_edge));
+  std::vector<std::vector<GovernorsPerWord> > expected(
+      1, GovernorFinder(&fs).GetTopGovernors());
+  return CountDifferentCells(actual, expected, 0.0) == 0;
+}
+
+// Where EdgePosteriorGovernorFinder is exact, its governors must be the ones
+// of GovernorFinder up to float rounding.
+static bool CheckEdgePosteriors(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  EdgePosteriorGovernorFinder ef(&fs);
+  if (!ef.exact()) {
+    return true;
+  }
+  std::vector<std::vector<GovernorsPerWord> > actual(1, ef.GetGovernors());
+  std::vector<std::vector<GovernorsPerWord> > expected(
+      1, GovernorFinder(&fs).GetTopGovernors());
+  return CountDifferentCells(actual, expected, 1e-5) == 0;
+}
+
+// Where EdgePosteriorGovernorFinder is exact, every derivation of a node
+// covers the same basic units and the markups sampled from 20000 derivations
+// must be within 5 standard errors of the ones of GovernorFinder.
+static bool CheckSampled(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  if (!EdgePosteriorGovernorFinder(&fs).exact()) {
+    return true;
+  }
+  SamplingOptions options;
+  options.num_samples = 20000;
+  options.seed = 1;
+  SampledGovernorFinder sf(&fs, options);
+  std::vector<GovernorsPerWord> actual = sf.GetGovernors();
+  std::vector<GovernorsPerWord> expected =
+      GovernorFinder(&fs).GetTopGovernors();
+  for (size_t j = 0; j < expected.size(); j++) {
+    if (expected[j].gms.empty() != actual[j].gms.empty()) {
+      return false;
+    }
+    // a markup not sampled has probability 0
+    for (size_t k = 0; k < actual[j].gms.size(); k++) {
+      bool found = false;
+      for (size_t e = 0; e < expected[j].gms.size(); e++) {
+        found = found || actual[j].gms[k] == expected[j].gms[e];
+      }
+      if (!found) {
+        return false;
+      }
+    }
+    for (size_t e = 0; e < expected[j].gms.size(); e++) {
+      double p = expected[j].gms[e].probability;
+      double estimate = 0.0;
+      for (size_t k = 0; k < actual[j].gms.size(); k++) {
+        if (actual[j].gms[k] == expected[j].gms[e]) {
+          estimate = actual[j].gms[k].probability;
+        }
+      }
+      if (fabs(estimate - p)
+          > 5 * sqrt(p * (1 - p) / options.num_samples) + 1e-6) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// A forest read from the prediction format and written with
+// WriteForestSentence must be read back exactly, as replay_slow_sentences
+// relies on.
+static bool CheckWriteForest(const ForestSentence& sentence) {
+  const char* tmpdir = getenv("TEST_TMPDIR");
+  std::string path = std::string(tmpdir != NULL ? tmpdir : "/tmp")
+                     + "/expected_governor_test.forest";
+  ForestSentence fs(sentence);
+  // log merits with more digits than the ones of data/
+  for (int e = 0; e < fs.forest().edges_size(); e++) {
+    HyperEdgeInfo* edge = fs.mutable_forest()->mutable_edges(e);
+    edge->set_merit(edge->merit() * (1.0f + e * 1e-3f));
+  }
+  FILE* out = fopen(path.c_str(), "w");
+  if (out == NULL) {
+    return false;
+  }
+  WriteForestSentence(out, fs);
+  fclose(out);
+  std::map<std::string, int> label_map;
+  std::vector<std::string> label_list;
+  std::map<std::string, int> binary_headrules;
+  ReadTcrfLabels(rule_path, &label_map, &label_list);
+  ReadBinaryHeadrules(binary_headrules_path, &binary_headrules);
+  std::ifstream fin(path.c_str());
+  ForestSentence read;
+  bool same = ReadForestSentence(fin, label_list, binary_headrules, &read)
+              && read.SerializeAsString() == fs.SerializeAsString();
+  remove(path.c_str());
+  return same;
+}
+
+// A plan which does not pick threading keeps the threads of the options.
+static bool CheckEnginePlan(const ForestSentence& fs) {
+  EngineThresholds thresholds;
+  thresholds.small_chart_cells = 0;
+  thresholds.num_threads = 4;
+  GovernorFinderOptions options;
+  options.num_threads = 3;
+  ForestFeatures features = ComputeForestFeatures(fs);
+  EnginePlan plan = SelectEngine(features, thresholds);
+  int expected = features.basic_units >= thresholds.threaded_basic_units
+                 ? thresholds.num_threads : options.num_threads;
+  return plan.Apply(options, thresholds).num_threads == expected;
+}
+
+// A grammar whose files are empty or truncated, e.g. while they are being
+// rewritten, must not replace the registered one.
+static bool CheckGrammarLoad() {
+  GrammarRegistry grammars;
+  if (!grammars.Load("default", rule_path, binary_headrules_path)) {
+    return false;
+  }
+  std::shared_ptr<const Grammar> loaded = grammars.Get("default");
+  const char* tmpdir = getenv("TEST_TMPDIR");
+  std::string path = std::string(tmpdir != NULL ? tmpdir : "/tmp")
+                     + "/expected_governor_test.grammar";
+  std::ifstream rules(rule_path);
+  std::string first_line;
+  std::getline(rules, first_line);
+  const std::string broken[] = {"", first_line + "\n", "3 0 0\nlabel\n"};
+  bool kept = true;
+  for (size_t b = 0; b < sizeof(broken) / sizeof(broken[0]); b++) {
+    std::ofstream(path.c_str()) << broken[b];
+    kept = kept && !grammars.Load("default", path, binary_headrules_path)
+           && !grammars.Load("default", rule_path, path)
+           && grammars.Get("default") == loaded;
+  }
+  remove(path.c_str());
+  return kept;
+}
+
+// The text of a count table.
+static std::string WrittenCounts(const GovernorCountTable& counts) {
+  FILE* out = tmpfile();
+  if (out == NULL) {
+    return "";
+  }
+  counts.Write(out);
+  rewind(out);
+  std::string text;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), out)) > 0) {
+    text.append(buffer, n);
+  }
+  fclose(out);
+  return text;
+}
+
+// A reloaded grammar numbering the labels in reverse must not change the
+// aggregate counts nor the feature ids of the markups, alone or merged with
+// counts of the original grammar.
+static bool CheckRelabeledGrammar(const std::vector<ForestSentence>& sentences,
+                                  const std::vector<std::string>& label_list) {
+  int num_of_labels = static_cast<int>(label_list.size());
+  std::vector<std::string> reversed(label_list.rbegin(), label_list.rend());
+  GovernorCountTable counts, relabeled_counts, merged_counts;
+  counts.SetLabels(label_list);
+  relabeled_counts.SetLabels(reversed);
+  merged_counts.SetLabels(label_list);
+  std::vector<int> templates(1, FEATURE_LABEL_U | FEATURE_LABEL_PARENT_OF_U);
+  FeatureHasher hasher(templates, 7), relabeled_hasher(templates, 7);
+  hasher.SetLabels(label_list);
+  relabeled_hasher.SetLabels(reversed);
+  bool same_ids = true;
+  for (size_t s = 0; s < sentences.size(); s++) {
+    ForestSentence fs(sentences[s]);
+    std::vector<GovernorsPerWord> governors =
+        GovernorFinder(&fs).GetTopGovernors();
+    std::vector<GovernorsPerWord> relabeled(governors);
+    for (size_t i = 0; i < relabeled.size(); i++) {
+      for (size_t j = 0; j < relabeled[i].gms.size(); j++) {
+        GovernorMarkup& m = relabeled[i].gms[j];
+        if (m.label_u != -1) {
+          m.label_u = num_of_labels - 1 - m.label_u;
+        }
+        if (m.label_parent_of_u != -1) {
+          m.label_parent_of_u = num_of_labels - 1 - m.label_parent_of_u;
+        }
+        std::vector<uint64_t> ids, relabeled_ids;
+        hasher.Hash(governors[i].gms[j], &ids);
+        relabeled_hasher.Hash(m, &relabeled_ids);
+        same_ids = same_ids && ids == relabeled_ids;
+      }
+    }
+    counts.Add(governors);
+    relabeled_counts.Add(relabeled);
+    merged_counts.Add(governors);
+  }
+  // the original counts twice, half of them under the reversed labels
+  GovernorCountTable doubled;
+  doubled.Merge(merged_counts);
+  doubled.Merge(relabeled_counts);
+  merged_counts.Merge(counts);
+  std::string written = WrittenCounts(counts);
+  return same_ids && !written.empty()
+         && WrittenCounts(relabeled_counts) == written
+         && WrittenCounts(doubled) == WrittenCounts(merged_counts);
+}
+
+// Workers sharing a cache while its statistics are read: every lookup is
+// counted once, and the cache holds the single result.
+static bool CheckSharedCache(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  std::vector<GovernorsPerWord> governors =
+      GovernorFinder(&fs).GetTopGovernors();
+  ForestKey key = HashForestSentence(fs);
+  GovernorCache cache(1 << 20);
+  const int num_threads = 4, lookups = 1000;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; t++) {
+    workers.push_back(std::thread([&cache, &key, &governors]() {
+      std::vector<GovernorsPerWord> result;
+      for (int l = 0; l < lookups; l++) {
+        if (!cache.Lookup(key, &result)) {
+          cache.Insert(key, governors);
+        }
+      }
+    }));
+  }
+  size_t max_size = 0;
+  for (int l = 0; l < lookups; l++) {
+    max_size = std::max(max_size, cache.size());
+    cache.hits();
+    cache.bytes();
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  return cache.hits() + cache.misses() == num_threads * lookups
+         && max_size <= 1 && cache.size() == 1;
+}
+
+// Every set of merits of BatchedGovernorFinder must give the chart of
+// GovernorFinder with these merits, including a set of zero merits (log
+// merits of -inf) whose cells can not be normalized.
+static bool CheckBatched(const ForestSentence& sentence) {
+  const ParseForest& forest = sentence.forest();
+  std::vector<std::vector<float> > merits(3);
+  for (int e = 0; e < forest.edges_size(); e++) {
+    merits[0].push_back(forest.edges(e).merit());
+    merits[1].push_back(forest.edges(e).merit() + log(1 + e % 5));
+    merits[2].push_back(-std::numeric_limits<float>::infinity());
+  }
+  BatchedGovernorFinder bf(&sentence, merits);
+  for (size_t k = 0; k < merits.size(); k++) {
+    ForestSentence fs(sentence);
+    for (int e = 0; e < forest.edges_size(); e++) {
+      fs.mutable_forest()->mutable_edges(e)->set_merit(merits[k][e]);
+    }
+    GovernorFinder gf(&fs);
+    std::vector<std::vector<GovernorsPerWord> > actual;
+    for (int i = 0; i < forest.nodes_size(); i++) {
+      actual.push_back(bf.GetGovernors(i, k));
+    }
+    if (CountDifferentCells(actual, gf.GetGovernors(), 1e-6) > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Querying every basic unit, in reverse order, must give the governors of the
+// top node of GovernorFinder.
+static bool CheckQuery(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  std::vector<int> basic_units;
+  for (int j = fs.basic_units_size() - 1; j >= 0; j--) {
+    basic_units.push_back(j);
+  }
+  std::vector<GovernorsPerWord> queried =
+      GovernorQuery(&fs, basic_units).GetGovernors();
+  std::vector<GovernorsPerWord> expected =
+      GovernorFinder(&fs).GetTopGovernors();
+  for (size_t q = 0; q < queried.size(); q++) {
+    if (queried[q].idx != basic_units[q]
+        || !SameCell(queried[q].gms, expected[basic_units[q]].gms, 0.0)) {
+      return false;
+    }
+  }
+  return queried.size() == expected.size();
+}
+
+// Shifting every log merit by the same constant is normalized away, so the
+// log semiring must give the same governors with scores far beyond the range
+// of exp in floats.
+static bool CheckExtremeMerits(const ForestSentence& sentence) {
+  ForestSentence fs(sentence);
+  std::vector<GovernorsPerWord> expected =
+      GovernorFinderT<LogSemiring>(&fs).GetTopGovernors();
+  const float shifts[] = {-300.0, 200.0};
+  for (size_t s = 0; s < sizeof(shifts) / sizeof(shifts[0]); s++) {
+    ForestSentence shifted(sentence);
+    for (int e = 0; e < shifted.forest().edges_size(); e++) {
+      HyperEdgeInfo* edge = shifted.mutable_forest()->mutable_edges(e);
+      edge->set_merit(edge->merit() + shifts[s]);
+    }
+    std::vector<GovernorsPerWord> actual =
+        GovernorFinderT<LogSemiring>(&shifted).GetTopGovernors();
+    if (actual.size() != expected.size()) {
+      return false;
+    }
+    for (size_t j = 0; j < actual.size(); j++) {
+      if (!SameCell(actual[j].gms, expected[j].gms, 1e-4)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+struct Check {
+  const char* name;
+  bool (*run)(const ForestSentence&);
+};
+
+int main() {
+  std::map<std::string, int> label_map;
+  std::vector<std::string> label_list;
+  std::map<std::string, int> binary_headrules;
+  if (!ReadTcrfLabels(rule_path, &label_map, &label_list)
+      || !ReadBinaryHeadrules(binary_headrules_path, &binary_headrules)) {
+    fprintf(stderr, "can not read %s or %s\n", rule_path,
+            binary_headrules_path);
+    return 1;
+  }
+  std::vector<ForestSentence> sentences;
+  std::ifstream fin(prediction_path);
+  while (true) {
+    ForestSentence fs;
+    if (!ReadForestSentence(fin, label_list, binary_headrules, &fs)) {
+      break;
+    }
+    if (fs.forest().nodes_size() > 0) {
+      sentences.push_back(fs);
+    }
+  }
+  if (sentences.empty()) {
+    fprintf(stderr, "can not read %s\n", prediction_path);
+    return 1;
+  }
+
+  const Check checks[] = {
+    {"update_edge_merits", CheckUpdateEdgeMerits},
+    {"memory_budget", CheckMemoryBudget},
+    {"spill_write_failure", CheckSpillWriteFailure},
+    {"viterbi", CheckViterbi},
+    {"single_derivation", CheckSingleDerivation},
+    {"edge_posteriors", CheckEdgePosteriors},
+    {"sampled", CheckSampled},
+    {"write_forest", CheckWriteForest},
+    {"engine_plan", CheckEnginePlan},
+    {"shared_cache", CheckSharedCache},
+    {"batched", CheckBatched},
+    {"query", CheckQuery},
+    {"extreme_merits", CheckExtremeMerits},
+  };
+  int failed_checks = 0;
+  if (CheckGrammarLoad()) {
+    printf("ok   grammar_load\n");
+  } else {
+    printf("FAIL grammar_load\n");
+    failed_checks++;
+  }
+  if (CheckRelabeledGrammar(sentences, label_list)) {
+    printf("ok   relabeled_grammar\n");
+  } else {
+    printf("FAIL relabeled_grammar\n");
+    failed_checks++;
+  }
+  for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+    int failures = 0;
+    for (size_t s = 0; s < sentences.size(); s++) {
+      if (!checks[c].run(sentences[s])) {
+        printf("FAIL %s: sentence %zu\n", checks[c].name, s);
+        failures++;
+      }
+    }
+    if (failures == 0) {
+      printf("ok   %s\n", checks[c].name);
+    } else {
+      failed_checks++;
+    }
+  }
+  return failed_checks == 0 ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Governor markups as hashed feature ids, written in a packed binary stream
+// which a model can ingest without any string processing.
+//
+// A feature template picks some of the fields of a markup: the label of u
+// (u), the label of its parent (p) and the headword of the parent (h), e.g.
+// "u+p+h" or "p+h". The id of a template for a markup is a 64 bit hash of the
+// seed, the template and the picked fields, in that order. Labels are hashed
+// by name, once per grammar (see SetLabels), so that a reloaded grammar which
+// numbers them differently gives the same ids; the headword is hashed once
+// per markup, which costs no more than looking it up in a table would. The
+// hash is defined here rather than by std::hash, so that ids are the same
+// across runs and platforms.
+//
+// The stream starts with a header
+//
+//   char[4] "GFH1", uint32 num_of_templates, uint64 seed
+//
+// followed by every sentence as
+//
+//   uint32 num_of_basic_units, uint32 status
+//   for every basic unit: int32 start, int32 end, uint32 num_of_markups
+//     for every markup: float probability, uint64 id[num_of_templates]
+//
+// in the byte order of the host, with status 0 for exact results and the
+// HashedFeatureStatus of approximate ones.
+//
+
+#ifndef NLU_CRF_FEATURE_HASH_H__
+#define NLU_CRF_FEATURE_HASH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "expected_governor.h"
+#include "forest_io.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+enum FeatureField {
+  FEATURE_LABEL_U = 1,
+  FEATURE_LABEL_PARENT_OF_U = 2,
+  FEATURE_HEADWORD_PARENT_OF_U = 4,
+};
+
+enum HashedFeatureStatus {
+  HASHED_FEATURES_EXACT = 0,
+  HASHED_FEATURES_DEGRADED = 1,
+  HASHED_FEATURES_REJECTED = 2,
+  HASHED_FEATURES_SAMPLED = 3,
+};
+
+// Parse comma separated templates of '+' separated fields (u, p, h) into
+// masks of FeatureField. Return false on an unknown or empty template.
+inline bool ParseFeatureTemplates(const std::string& spec,
+                                  std::vector<int>* templates) {
+  templates->clear();
+  std::vector<std::string> names = split(spec, ',');
+  for (size_t t = 0; t < names.size(); t++) {
+    std::vector<std::string> fields = split(names[t], '+');
+    int mask = 0;
+    for (size_t f = 0; f < fields.size(); f++) {
+      if (fields[f] == "u") {
+        mask |= FEATURE_LABEL_U;
+      } else if (fields[f] == "p") {
+        mask |= FEATURE_LABEL_PARENT_OF_U;
+      } else if (fields[f] == "h") {
+        mask |= FEATURE_HEADWORD_PARENT_OF_U;
+      } else {
+        return false;
+      }
+    }
+    if (mask == 0) {
+      return false;
+    }
+    templates->push_back(mask);
+  }
+  return !templates->empty();
+}
+
+class FeatureHasher {
+ public:
+  FeatureHasher(const std::vector<int>& feature_templates, uint64_t seed)
+    : templates(feature_templates), seed_(seed) {}
+
+  // hash the names of the label indexes of the markups hashed from now on
+  void SetLabels(const std::vector<std::string>& label_list) {
+    label_hashes.resize(label_list.size());
+    for (size_t i = 0; i < label_list.size(); i++) {
+      label_hashes[i] = Fnv(label_list[i]);
+    }
+  }
+
+  // append the id of every template for markup m to ids
+  void Hash(const GovernorMarkup& m, std::vector<uint64_t>* ids) const {
+    uint64_t headword = 0;
+    bool headword_hashed = false;
+    for (size_t t = 0; t < templates.size(); t++) {
+      int mask = templates[t];
+      uint64_t h = Mix(seed_ ^ static_cast<uint64_t>(mask));
+      if (mask & FEATURE_LABEL_U) {
+        h = Mix(h ^ labelHash(m.label_u));
+      }
+      if (mask & FEATURE_LABEL_PARENT_OF_U) {
+        h = Mix(h ^ labelHash(m.label_parent_of_u));
+      }
+      if (mask & FEATURE_HEADWORD_PARENT_OF_U) {
+        if (!headword_hashed) {
+          headword = Fnv(m.headword_parent_of_u);
+          headword_hashed = true;
+        }
+        h = Mix(h ^ headword);
+      }
+      ids->push_back(h);
+    }
+  }
+
+  const std::vector<int>& feature_templates() const {
+    return templates;
+  }
+
+  uint64_t seed() const {
+    return seed_;
+  }
+
+ private:
+  // the finalizer of splitmix64
+  static uint64_t Mix(uint64_t v) {
+    v += 0x9e3779b97f4a7c15ULL;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    return v ^ (v >> 31);
+  }
+
+  // FNV-1a of the bytes of a string
+  static uint64_t Fnv(const std::string& str) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < str.size(); i++) {
+      h = (h ^ static_cast<unsigned char>(str[i])) * 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+  // the hash of the name of a label index, -1 (ROOT or NONE) as before
+  uint64_t labelHash(int label) const {
+    return label == -1 ? 0xffffffffULL : label_hashes[label];
+  }
+
+  std::vector<int> templates;
+  uint64_t seed_;
+  std::vector<uint64_t> label_hashes;
+};
+
+// Writes the stream described above, one sentence at a time.
+class HashedFeatureWriter {
+ public:
+  HashedFeatureWriter(FILE* output, const std::vector<int>& feature_templates,
+                      uint64_t seed)
+    : out(output), hasher(feature_templates, seed) {
+    buffer.append("GFH1", 4);
+    append<uint32_t>(feature_templates.size());
+    append<uint64_t>(seed);
+    flush();
+  }
+
+  // see FeatureHasher::SetLabels
+  void SetLabels(const std::vector<std::string>& label_list) {
+    hasher.SetLabels(label_list);
+  }
+
+  void WriteSentence(const ForestSentence& fs,
+                     const std::vector<GovernorsPerWord>& governors,
+                     HashedFeatureStatus status) {
+    append<uint32_t>(fs.basic_units_size());
+    append<uint32_t>(status);
+    for (int i = 0; i < fs.basic_units_size(); i++) {
+      const std::vector<GovernorMarkup>& gms = governors[i].gms;
+      append<int32_t>(fs.basic_units(i).start());
+      append<int32_t>(fs.basic_units(i).end());
+      append<uint32_t>(gms.size());
+      for (size_t j = 0; j < gms.size(); j++) {
+        append<float>(gms[j].probability);
+        ids.clear();
+        hasher.Hash(gms[j], &ids);
+        buffer.append(reinterpret_cast<const char*>(&ids[0]),
+                      ids.size() * sizeof(uint64_t));
+      }
+    }
+    flush();
+  }
+
+ private:
+  template <class T>
+  void append(T value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void flush() {
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    buffer.clear();
+  }
+
+  FILE* out;
+  FeatureHasher hasher;
+  // the sentence being written, and the ids of a markup
+  std::string buffer;
+  std::vector<uint64_t> ids;
+};
+
+} // namespace nlu
+
+#endif
@@ -6,6 +6,8 @@
 // Find expected governor given a parse forset output.
 //
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <set>
@@ -14,182 +16,482 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <memory>
 #include <math.h>
+#include <signal.h>
 
+#include "async_io.h"
+#include "best_derivation.h"
+#include "compressed_input.h"
+#include "command_line_flags.h"
+#include "edge_posterior_governor.h"
+#include "engine_selector.h"
 #include "expected_governor.h"
+#include "feature_hash.h"
+#include "forest_io.h"
+#include "forest_reorder.h"
+#include "forest_simplifier.h"
+#include "governor_cache.h"
+#include "governor_counts.h"
+#include "grammar.h"
 #include "parse_forest.pb.h"
+#include "sampled_governor.h"
+#include "streaming_governor.h"
 
 #define tcrf_prediction_path "data/tcrf_predict"
 #define rule_path "data/tcrf_rule" 
 #define binary_headrules_path "data/binary_headrules" 
 #define output_path "data/tcrf_expected_governor"
+#define slow_sentence_path "data/slow_sentences"
 
 using namespace nlu;
 
-std::vector<std::string> &split(const std::string &s, char delim, 
-                                std::vector<std::string> &elems) {
-  std::stringstream ss(s);
-  std::string item;
-  while (std::getline(ss, item, delim)) {
-      elems.push_back(item);
+// set by SIGHUP with --reload_grammar_on_sighup, and handled between sentences
+static volatile sig_atomic_t grammar_reload_requested = 0;
+
+static void RequestGrammarReload(int) {
+  grammar_reload_requested = 1;
+}
+
+// governors of the top node computed with GovernorFinderT<Semiring>; the
+// semiring is fixed at compile time so that each gets its own inner loop
+template <class Semiring>
+std::vector<GovernorsPerWord> FindGovernors(
+    ForestSentence* fs, const GovernorFinderOptions& finder_options,
+    GovernorFinderStatus* status, size_t* max_cell_size) {
+  GovernorFinderT<Semiring> gf(fs, finder_options);
+  *status = gf.status();
+  *max_cell_size = gf.MaxCellSize();
+  if (*status == GOVERNOR_REJECTED) {
+    return std::vector<GovernorsPerWord>(fs->basic_units_size());
   }
-  return elems;
+  return gf.GetTopGovernors();
 }
 
-std::vector<std::string> split(const std::string &s, char delim) {
-  std::vector<std::string> elems;
-  split(s, delim, elems);
-  return elems;
+// Read the next sentence and compute the governors of its top node while its
+// edges are being read, counting it in recomputed if it had to be computed
+// again by GovernorFinder. Return false at the end of the input.
+template <class Semiring>
+bool StreamGovernors(std::istream& fin,
+                     const std::vector<std::string>& label_list,
+                     const std::map<std::string, int>& binary_headrules,
+                     ForestSentence* fs,
+                     std::vector<GovernorsPerWord>* result,
+                     int* recomputed) {
+  StreamingGovernorFinderT<Semiring> sgf(fs);
+  if (!sgf.Read(fin, label_list, binary_headrules)) {
+    return false;
+  }
+  if (sgf.Recomputed()) {
+    (*recomputed)++;
+  }
+  *result = sgf.GetGovernors();
+  return true;
 }
 
 int main(int argc, char **argv) {
-  std::map<std::string, int> label_map;
-  std::vector<std::string> label_list;
-  // read tcrf rules
-  int num_of_labels, num_of_urules, num_of_brules;
-  std::ifstream fin_rule(rule_path);
-  fin_rule >> num_of_labels;
-  fin_rule >> num_of_urules;
-  fin_rule >> num_of_brules;
-  for (int i = 0; i < num_of_labels; i++) {
-    int idx;
-    float f1, f2;
-    std::string tmp, label;
-    fin_rule >> tmp >> idx >> label >> f1 >> f2;
-    label_map[label] = idx;
-    label_list.push_back(label);
-  }
-  fin_rule.close();
-
-  std::map<std::string, int> binary_headrules;
-  // read binary headrules
-  std::ifstream fin_bhr(binary_headrules_path);
-  int num;
-  fin_bhr >> num;
-  for (int i = 0; i < num; i++) {
-    std::string brules;
-    int head_idx, count;
-    fin_bhr >> brules >> head_idx >> count;
-    binary_headrules[brules] = head_idx;
-  }
-  fin_bhr.close();
+  CommandLineFlags flags = parse_flags(argc, argv);
+  // remove unreachable nodes and merge duplicate edges before propagation
+  bool simplify_forest = flag_bool(flags, "simplify_forest");
+  // skip unary edges which only copy the markups of their child, then
+  // simplify the forest to drop the bypassed nodes
+  bool collapse_unary = flag_bool(flags, "collapse_unary");
+  long long collapsed_tails = 0;
+  // renumber the nodes so that each comes right after the subforests of its
+  // children; only the top node, which stays last, is written
+  bool reorder_forest = flag_bool(flags, "reorder_forest");
+  SimplifyStats simplify_total;
+  GovernorFinderOptions finder_options;
+  // partition the basic units of a sentence across threads
+  finder_options.num_threads = flag_int(flags, "bu_threads", 1);
+  // per sentence budget, after which cells are pruned and the sentence is
+  // flagged as degraded in the output
+  finder_options.max_markups = flag_int(flags, "max_markups", 0);
+  finder_options.time_budget_ms = flag_int(flags, "time_budget_ms", 0);
+  finder_options.degraded_cell_size = flag_int(flags, "degraded_cell_size", 1);
+  // memory budget of the governor chart of a sentence; sentences whose chart
+  // can not fit even when pruned are flagged as rejected
+  finder_options.max_bytes =
+      static_cast<size_t>(flag_int(flags, "max_chart_mb", 0)) << 20;
+  // keep only the rows of the chart still needed in memory, spilling the
+  // others to a scratch file
+  finder_options.spill_path = flag_string(flags, "spill_path", "");
+  // share the cells which are scaled copies of a child cell
+  finder_options.share_cells = flag_bool(flags, "share_cells");
+  // only the best governor of every basic unit, from the best derivation
+  bool viterbi = flag_bool(flags, "viterbi");
+  // semiring of the propagation: probability, log or max_product
+  std::string semiring = flag_string(flags, "semiring", "probability");
+  if (semiring != "probability" && semiring != "log"
+      && semiring != "max_product") {
+    fprintf(stderr, "unknown semiring %s\n", semiring.c_str());
+    return 1;
+  }
+  // compute the governors while reading the edges of each sentence, keeping
+  // only the rows of the chart still readable; the options of the finder
+  // and the other engines do not apply
+  bool streaming = flag_bool(flags, "streaming");
+  int recomputed_sentences = 0;
+  // walk the single derivation of unambiguous forests instead of filling a
+  // chart
+  bool fast_unambiguous = flag_bool(flags, "fast_unambiguous");
+  int unambiguous_sentences = 0;
+  // sum edge posteriors in linear time for the forests on which this gives
+  // the result of GovernorFinder, and run GovernorFinder on the others
+  bool edge_posteriors = flag_bool(flags, "edge_posteriors");
+  int edge_posterior_sentences = 0, edge_posterior_fallbacks = 0;
+  int viterbi_sentences = 0, viterbi_fallbacks = 0;
+  // choose per sentence between the finders and their options above from
+  // the size and shape of the forest, see engine_selector.h
+  bool adaptive = flag_bool(flags, "adaptive");
+  EngineThresholds thresholds;
+  thresholds.small_chart_cells =
+      flag_int(flags, "adaptive_small_cells", thresholds.small_chart_cells);
+  thresholds.collapse_unary_ratio = flag_double(
+      flags, "adaptive_unary_ratio", thresholds.collapse_unary_ratio);
+  thresholds.threaded_basic_units = flag_int(
+      flags, "adaptive_threaded_basic_units", thresholds.threaded_basic_units);
+  thresholds.num_threads = flag_int(flags, "adaptive_threads",
+                                    finder_options.num_threads);
+  thresholds.prune_edges_per_node = flag_double(
+      flags, "adaptive_prune_edges_per_node", thresholds.prune_edges_per_node);
+  thresholds.prune_max_markups = flag_int(flags, "adaptive_prune_markups", 0);
+  EngineStats engine_stats;
+  // estimate the governors from --samples derivations sampled with
+  // --sample_seed instead of running GovernorFinder; such sentences are
+  // written with "sampled" on their first line
+  SamplingOptions sampling_options;
+  sampling_options.num_samples = flag_int(flags, "samples", 0);
+  sampling_options.seed = flag_uint64(flags, "sample_seed", 0);
+  int sampled_sentences = 0;
+  double max_standard_error = 0.0;
+  // read ahead the input and write behind the output in --io_buffers
+  // buffers of --io_buffer_kb each, on io_uring unless --io_threads
+  bool async_io = flag_bool(flags, "async_io");
+  AsyncIoOptions io_options;
+  io_options.num_buffers = flag_int(flags, "io_buffers", 4);
+  io_options.buffer_size =
+      static_cast<size_t>(flag_int(flags, "io_buffer_kb", 1024)) << 10;
+  io_options.io_uring = !flag_bool(flags, "io_threads");
+  // accumulate the expected counts of the governor markups over all
+  // sentences and write only this table to --aggregate_output, instead of
+  // the governors of every sentence
+  std::string aggregate_path = flag_string(flags, "aggregate_output", "");
+  std::unique_ptr<GovernorCountTable> counts;
+  if (!aggregate_path.empty()) {
+    counts.reset(new GovernorCountTable);
+  }
+  int degraded_sentences = 0, rejected_sentences = 0;
+  // write hashed ids of the --feature_templates of every markup, seeded with
+  // --feature_seed, to --feature_output in the binary format of
+  // feature_hash.h instead of the text output
+  std::string feature_path = flag_string(flags, "feature_output", "");
+  std::vector<int> feature_templates;
+  if (!ParseFeatureTemplates(flag_string(flags, "feature_templates", "u+p+h"),
+                             &feature_templates)) {
+    fprintf(stderr, "bad --feature_templates, expected e.g. u+p+h,p+h\n");
+    return 1;
+  }
+  uint64_t feature_seed = flag_uint64(flags, "feature_seed", 0);
+  if (!aggregate_path.empty() && !feature_path.empty()) {
+    // both replace the per-sentence output, and only one can
+    fprintf(stderr, "--aggregate_output and --feature_output can not be "
+            "combined\n");
+    return 1;
+  }
+  std::string output = feature_path.empty() ? output_path : feature_path;
+  std::unique_ptr<HashedFeatureWriter> features;
+  // reuse results of previously seen forests, bounded by --cache_mb
+  std::unique_ptr<GovernorCache> cache;
+  if (flag_int(flags, "cache_mb", 0) > 0) {
+    cache.reset(new GovernorCache(
+        static_cast<size_t>(flag_int(flags, "cache_mb", 0)) << 20));
+  }
+  if (streaming && (viterbi || sampling_options.num_samples > 0
+                    || finder_options.max_markups > 0
+                    || finder_options.time_budget_ms > 0
+                    || finder_options.max_bytes > 0 || cache)) {
+    // the streaming finder always gives the exact result of GovernorFinder,
+    // which these would change, bound or skip
+    fprintf(stderr, "--streaming can not be combined with --viterbi, "
+            "--samples, --max_markups, --time_budget_ms, --max_chart_mb or "
+            "--cache_mb\n");
+    return 1;
+  }
+  // sentences on which GovernorFinder spends at least --slow_sentence_ms are
+  // dumped in the prediction format to --slow_sentence_path, with one line of
+  // "sentence_idx nodes edges basic_units max_cell_size ms" per sentence in
+  // <slow_sentence_path>.stats
+  int slow_sentence_ms = flag_int(flags, "slow_sentence_ms", -1);
+  FILE* slow_sentences = NULL;
+  FILE* slow_sentence_stats = NULL;
+  if (slow_sentence_ms >= 0) {
+    std::string path = flag_string(flags, "slow_sentence_path",
+                                   slow_sentence_path);
+    slow_sentences = fopen(path.c_str(), "w");
+    slow_sentence_stats = fopen((path + ".stats").c_str(), "w");
+    if (slow_sentences == NULL || slow_sentence_stats == NULL) {
+      fprintf(stderr, "can not open %s or %s.stats\n", path.c_str(),
+              path.c_str());
+      return 1;
+    }
+  }
+
+  // read tcrf rules and binary headrules
+  GrammarRegistry grammars;
+  if (!grammars.Load("default", rule_path, binary_headrules_path)) {
+    fprintf(stderr, "can not read %s or %s\n", rule_path,
+            binary_headrules_path);
+    return 1;
+  }
+  // re-read the grammar on SIGHUP, for the sentences read after it
+  if (flag_bool(flags, "reload_grammar_on_sighup")) {
+    signal(SIGHUP, RequestGrammarReload);
+  }
 
   // read prediction file
-  std::ifstream fin(tcrf_prediction_path);
-  FILE* outfile = fopen(output_path, "w");
-  int num_of_tokens, num_of_basic_units, num_of_nodes, num_of_edges;
-  while (fin >> num_of_tokens) {
-    ForestSentence fs;
-    for (int i = 0; i < num_of_tokens; i++) {
-      std::string segment;
-      fin >> segment;
-      fs.add_tokens(segment);
+  std::ifstream file_in;
+  std::unique_ptr<AsyncInputBuffer> async_input;
+  std::unique_ptr<AsyncOutputBuffer> async_output;
+  FILE* outfile = NULL;
+  if (async_io) {
+    async_input.reset(new AsyncInputBuffer(tcrf_prediction_path, io_options));
+    if (!counts) {
+      async_output.reset(new AsyncOutputBuffer(output, io_options));
+      outfile = OpenAsyncOutputFile(async_output.get());
     }
-
-    ParseForest* forest = fs.mutable_forest();
-    fin >> num_of_nodes;
-    if (num_of_nodes == -1) {
-      continue;
+    if (!async_input->is_open()
+        || (async_output && !async_output->is_open())) {
+      fprintf(stderr, "can not open %s or %s\n", tcrf_prediction_path,
+              output.c_str());
+      return 1;
     }
-    for (int i = 0; i < num_of_nodes; i++) {
-      std::string index;
-      int stt, end, tag, upper, basic_unit;
-      float inside_score, outside_score;
-      fin >> index >> stt >> end >> tag >> upper >> basic_unit 
-          >> inside_score >> outside_score;
-
-      NodeInfo* node = forest->add_nodes();
-      node->set_start(stt);
-      node->set_end(end);
-      node->set_label(tag);
-      node->set_upper(upper);
-      node->set_basic_unit(basic_unit);
-      node->set_inside_score(inside_score);
-      node->set_outside_score(outside_score);
-
-      if (basic_unit == 1 && upper == 0) {
-        node->set_headword_stt(stt);
-        node->set_headword_end(end);
-        BasicUnit* bu = fs.add_basic_units();
-        bu->set_start(stt);
-        bu->set_end(end);
-      } else {
-        node->set_headword_stt(-1);
-        node->set_headword_end(-1);
-      }
-    }
-
-    int last_head = -1, edge_idx = 0;
-    fin >> num_of_edges;
-    std::string line;
-    std::getline(fin, line);
-    for (int i = 0; i < num_of_edges; i++) {
-      std::getline(fin, line);
-      std::vector<std::string> strs = split(line, ' ');
-      if (strs.size() == 3) {
-        // unary rule
-        int head = std::stoi(strs[0]);
-        int tail = std::stoi(strs[1]);
-        float merit = std::stof(strs[2]);
-
-        NodeInfo* head_node = forest->mutable_nodes(head);
-        NodeInfo* tail_node = forest->mutable_nodes(tail);
-        head_node->set_headword_stt(tail_node->headword_stt());
-        head_node->set_headword_end(tail_node->headword_end());
-
-        if (head != last_head) {
-          for (int j = last_head + 1; j <= head; j++) {
-            forest->add_starting_indexes(edge_idx);
-          }
-          last_head = head;
+    fprintf(stderr, "async_io: %s\n",
+            async_input->UsesIoUring() ? "io_uring" : "threads");
+  } else {
+    file_in.open(tcrf_prediction_path);
+    if (!counts) {
+      outfile = fopen(output.c_str(), "w");
+    }
+  }
+  if (outfile != NULL && !feature_path.empty()) {
+    features.reset(new HashedFeatureWriter(outfile, feature_templates,
+                                           feature_seed));
+  }
+  std::streambuf* input =
+      async_io ? static_cast<std::streambuf*>(async_input.get())
+               : file_in.rdbuf();
+  // a compressed prediction file is inflated on its own thread
+  std::unique_ptr<GzipInputBuffer> gzip_input;
+  Compression compression = DetectCompression(tcrf_prediction_path);
+  if (compression == COMPRESSION_ZSTD) {
+    fprintf(stderr, "%s is zstd compressed, which is not supported; "
+            "decompress it or recompress it with gzip\n",
+            tcrf_prediction_path);
+    return 1;
+  }
+  if (compression == COMPRESSION_GZIP) {
+    gzip_input.reset(new GzipInputBuffer(input, io_options));
+    input = gzip_input.get();
+  }
+  std::istream fin(input);
+  int sentence_idx = -1;
+  // the grammar whose label indexes the aggregate table and the feature ids
+  // were last told the names of
+  std::shared_ptr<const Grammar> labeled_grammar;
+  // non-zero if the input could not be read to its end
+  int exit_status = 0;
+  while (true) {
+    if (grammar_reload_requested) {
+      grammar_reload_requested = 0;
+      if (grammars.Load("default", rule_path, binary_headrules_path)) {
+        fprintf(stderr, "reloaded the grammar before sentence %d\n",
+                sentence_idx + 1);
+        // cached results hold label indexes of the previous grammar
+        if (cache) {
+          cache->Clear();
         }
-        HyperEdgeInfo* edge = forest->add_edges();
-        edge->set_merit(exp(merit));
-        edge->set_head_idx(head);
-        edge->add_tail_idx(tail);
-        edge_idx++;
       } else {
-        // binary rule
-        int head = std::stoi(strs[0]);
-        int tail0 = std::stoi(strs[1]);
-        int tail1 = std::stoi(strs[2]);
-        float merit = std::stof(strs[3]);
-
-        NodeInfo* head_node = forest->mutable_nodes(head);
-        NodeInfo* tail_node0 = forest->mutable_nodes(tail0);
-        NodeInfo* tail_node1 = forest->mutable_nodes(tail1);
-        std::string rule = label_list[head_node->label()] + "^" + 
-                           label_list[tail_node0->label()] + "^" + 
-                           label_list[tail_node1->label()];
-        if (binary_headrules[rule] == 0) {
-          head_node->set_headword_stt(tail_node0->headword_stt());
-          head_node->set_headword_end(tail_node0->headword_end());
-        }
-        else {
-          head_node->set_headword_stt(tail_node1->headword_stt());
-          head_node->set_headword_end(tail_node1->headword_end());
-        }
+        fprintf(stderr, "can not reload the grammar, keeping the previous "
+                "one\n");
+      }
+    }
+    // the grammar of this sentence, kept alive until it is written out
+    std::shared_ptr<const Grammar> grammar = grammars.Get("default");
+    const std::vector<std::string>& label_list = grammar->label_list();
+    const std::map<std::string, int>& binary_headrules =
+        grammar->binary_headrules();
+    if (grammar != labeled_grammar) {
+      if (counts) {
+        counts->SetLabels(label_list);
+      }
+      if (features) {
+        features->SetLabels(label_list);
+      }
+      labeled_grammar = grammar;
+    }
+    ForestSentence fs;
+    std::vector<GovernorsPerWord> result;
+    bool read;
+    if (!streaming) {
+      read = ReadForestSentence(fin, label_list, binary_headrules, &fs);
+    } else if (semiring == "log") {
+      read = StreamGovernors<LogSemiring>(fin, label_list, binary_headrules,
+                                          &fs, &result,
+                                          &recomputed_sentences);
+    } else if (semiring == "max_product") {
+      read = StreamGovernors<MaxProductSemiring>(
+          fin, label_list, binary_headrules, &fs, &result,
+          &recomputed_sentences);
+    } else {
+      read = StreamGovernors<ProbabilitySemiring>(
+          fin, label_list, binary_headrules, &fs, &result,
+          &recomputed_sentences);
+    }
+    if (!read) {
+      break;
+    }
+    sentence_idx++;
+    if (fs.forest().nodes_size() == 0) {
+      continue;
+    }
+
+    ForestKey key;
+    bool cached = streaming;
+    GovernorFinderStatus status = GOVERNOR_OK;
+    bool sampled = false;
+    if (cache && !streaming) {
+      key = HashForestSentence(fs);
+      cached = cache->Lookup(key, &result);
+    }
 
-        if (head != last_head) {
-          for (int j = last_head + 1; j <= head; j++) {
-            forest->add_starting_indexes(edge_idx);
-          }
-          last_head = head;
+    if (!cached) {
+      EnginePlan plan;
+      GovernorFinderOptions sentence_options = finder_options;
+      if (adaptive && !viterbi) {
+        plan = SelectEngine(ComputeForestFeatures(fs), thresholds);
+        sentence_options = plan.Apply(finder_options, thresholds);
+      }
+      // the forest as read, which the slow sentence dump keeps so that
+      // replay_slow_sentences simplifies it the same way
+      bool simplified = collapse_unary || plan.collapse_unary
+                        || simplify_forest || reorder_forest;
+      ForestSentence read_fs;
+      if (slow_sentences != NULL && simplified) {
+        read_fs = fs;
+      }
+      if (collapse_unary || plan.collapse_unary) {
+        collapsed_tails += CollapseUnaryChains(fs.mutable_forest());
+      }
+      if (simplify_forest || collapse_unary || plan.collapse_unary) {
+        SimplifyStats stats = SimplifyForest(&fs, semiring == "max_product");
+        simplify_total.removed_nodes += stats.removed_nodes;
+        simplify_total.removed_edges += stats.removed_edges;
+        simplify_total.merged_edges += stats.merged_edges;
+      }
+      if (reorder_forest) {
+        ReorderForest(&fs);
+      }
+
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      size_t max_cell_size = 1;
+      std::vector<int> derivation_edge;
+      bool unambiguous = (fast_unambiguous || plan.single_derivation)
+                         && !viterbi && SingleDerivation(fs, &derivation_edge);
+      if (unambiguous) {
+        unambiguous_sentences++;
+      }
+      std::unique_ptr<EdgePosteriorGovernorFinder> ef;
+      if ((edge_posteriors || plan.edge_posteriors) && !viterbi
+          && !unambiguous) {
+        ef.reset(new EdgePosteriorGovernorFinder(&fs));
+        if (ef->exact()) {
+          edge_posterior_sentences++;
+        } else {
+          edge_posterior_fallbacks++;
         }
-        HyperEdgeInfo* edge = forest->add_edges();
-        edge->set_merit(exp(merit));
-        edge->set_head_idx(head);
-        edge->add_tail_idx(tail0);
-        edge->add_tail_idx(tail1);
-        edge_idx++;
+      }
+      std::unique_ptr<ViterbiGovernorFinder> vf;
+      if (viterbi) {
+        vf.reset(new ViterbiGovernorFinder(&fs));
+        if (vf->exact()) {
+          viterbi_sentences++;
+        } else {
+          viterbi_fallbacks++;
+        }
+      }
+      if (vf && vf->exact()) {
+        result = vf->GetGovernors();
+      } else if (unambiguous) {
+        result = DerivationGovernors(fs, derivation_edge);
+      } else if (ef && ef->exact()) {
+        result = ef->GetGovernors();
+      } else if (sampling_options.num_samples > 0) {
+        SampledGovernorFinder sf(&fs, sampling_options);
+        result = sf.GetGovernors();
+        sampled = true;
+        sampled_sentences++;
+        max_standard_error = std::max(max_standard_error,
+                                      sf.MaxStandardError());
+      } else if (semiring == "log") {
+        result = FindGovernors<LogSemiring>(&fs, sentence_options, &status,
+                                            &max_cell_size);
+      } else if (semiring == "max_product") {
+        result = FindGovernors<MaxProductSemiring>(&fs, sentence_options,
+                                                   &status, &max_cell_size);
+      } else {
+        result = FindGovernors<ProbabilitySemiring>(&fs, sentence_options,
+                                                    &status, &max_cell_size);
+      }
+      double elapsed_ms = std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count();
+      if (adaptive && !viterbi) {
+        engine_stats.Add(PlannedEngine(plan, unambiguous, ef && ef->exact()),
+                         elapsed_ms);
+      }
+      if (slow_sentences != NULL && elapsed_ms >= slow_sentence_ms) {
+        WriteForestSentence(slow_sentences, simplified ? read_fs : fs);
+        fprintf(slow_sentence_stats, "%d %d %d %d %zu %.3f\n", sentence_idx,
+                fs.forest().nodes_size(), fs.forest().edges_size(),
+                fs.basic_units_size(), max_cell_size, elapsed_ms);
+      }
+      if (cache && status == GOVERNOR_OK && !sampled) {
+        cache->Insert(key, result);
       }
     }
-    forest->add_starting_indexes(edge_idx);
-
-    GovernorFinder gf(&fs);
-    std::vector<GovernorsPerWord> result = 
-        gf.GetGovernors()[fs.forest().nodes_size()-1];
-    fprintf(outfile, "%d\n", fs.basic_units_size());
+    if (counts) {
+      // degraded sentences count with their pruned governors, rejected ones
+      // have none
+      if (status == GOVERNOR_DEGRADED) {
+        degraded_sentences++;
+      } else if (status == GOVERNOR_REJECTED) {
+        rejected_sentences++;
+      }
+      counts->Add(result);
+      continue;
+    }
+    if (features) {
+      HashedFeatureStatus feature_status = HASHED_FEATURES_EXACT;
+      if (status == GOVERNOR_DEGRADED) {
+        feature_status = HASHED_FEATURES_DEGRADED;
+      } else if (status == GOVERNOR_REJECTED) {
+        feature_status = HASHED_FEATURES_REJECTED;
+      } else if (sampled) {
+        feature_status = HASHED_FEATURES_SAMPLED;
+      }
+      features->WriteSentence(fs, result, feature_status);
+      continue;
+    }
+    if (status == GOVERNOR_DEGRADED) {
+      fprintf(outfile, "%d degraded\n", fs.basic_units_size());
+    } else if (status == GOVERNOR_REJECTED) {
+      fprintf(outfile, "%d rejected\n", fs.basic_units_size());
+    } else if (sampled) {
+      fprintf(outfile, "%d sampled\n", fs.basic_units_size());
+    } else {
+      fprintf(outfile, "%d\n", fs.basic_units_size());
+    }
     for (int i = 0; i < fs.basic_units_size(); i++) {
       fprintf(outfile, "%d %d %d\n", fs.basic_units(i).start(), 
               fs.basic_units(i).end(), result[i].gms.size());
@@ -209,6 +511,80 @@ int main(int argc, char **argv) {
       }
     }
   }
-  fclose(outfile);
-  fin.close();
+  if (outfile != NULL) {
+    fclose(outfile);
+  }
+  if (gzip_input && !gzip_input->Error().empty()) {
+    fprintf(stderr, "%s: %s\n", tcrf_prediction_path,
+            gzip_input->Error().c_str());
+    exit_status = 1;
+  }
+  if (async_input && !async_input->Error().empty()) {
+    fprintf(stderr, "%s: %s\n", tcrf_prediction_path,
+            async_input->Error().c_str());
+    exit_status = 1;
+  }
+  gzip_input.reset();
+  file_in.close();
+  if (counts) {
+    FILE* aggregate_file = fopen(aggregate_path.c_str(), "w");
+    if (aggregate_file == NULL) {
+      fprintf(stderr, "can not open %s\n", aggregate_path.c_str());
+      return 1;
+    }
+    counts->Write(aggregate_file);
+    fclose(aggregate_file);
+    fprintf(stderr, "aggregate_output: %zu markups over %lld sentences, "
+            "%d degraded, %d rejected\n", counts->size(),
+            counts->num_of_sentences(), degraded_sentences,
+            rejected_sentences);
+  }
+  if (slow_sentences != NULL) {
+    fclose(slow_sentences);
+    fclose(slow_sentence_stats);
+  }
+
+  if (collapse_unary) {
+    fprintf(stderr, "collapse_unary: redirected %lld tails\n",
+            collapsed_tails);
+  }
+  if (simplify_forest || collapse_unary) {
+    fprintf(stderr, "simplify_forest: removed %d nodes and %d edges, "
+            "merged %d duplicate edges\n", simplify_total.removed_nodes,
+            simplify_total.removed_edges, simplify_total.merged_edges);
+  }
+  if (streaming) {
+    fprintf(stderr, "streaming: %d sentences recomputed by GovernorFinder\n",
+            recomputed_sentences);
+  }
+  if (fast_unambiguous) {
+    fprintf(stderr, "fast_unambiguous: %d sentences with a single "
+            "derivation\n", unambiguous_sentences);
+  }
+  if (edge_posteriors) {
+    fprintf(stderr, "edge_posteriors: %d sentences solved, %d fell back to "
+            "GovernorFinder\n", edge_posterior_sentences,
+            edge_posterior_fallbacks);
+  }
+  if (viterbi) {
+    fprintf(stderr, "viterbi: %d sentences solved, %d fell back to "
+            "GovernorFinder\n", viterbi_sentences, viterbi_fallbacks);
+  }
+  if (adaptive && !viterbi) {
+    engine_stats.Print(stderr, thresholds);
+  }
+  if (sampling_options.num_samples > 0) {
+    fprintf(stderr, "sampling: %d sentences of %d samples, largest standard "
+            "error %f\n", sampled_sentences, sampling_options.num_samples,
+            max_standard_error);
+  }
+  if (cache) {
+    fprintf(stderr, "result_cache: %llu hits, %llu misses, %llu evictions, "
+            "%zu entries, %zu bytes\n",
+            (unsigned long long) cache->hits(),
+            (unsigned long long) cache->misses(),
+            (unsigned long long) cache->evictions(), cache->size(),
+            cache->bytes());
+  }
+  return exit_status;
 }
@@ -0,0 +1,297 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Reading the grammar and the tcrf prediction (parse forest) files, and
+// writing forest sentences back in the prediction format.
+//
+// A sentence in the prediction file looks like
+//
+//   <num_of_tokens>
+//   <token>                                   (one per line)
+//   <num_of_nodes>                            (-1 if parsing failed)
+//   <idx>: <stt> <end> <tag> <upper> <basic_unit> [<inside> <outside>]
+//   <num_of_edges>
+//   <head> <tail> <merit>                     (unary rule)
+//   <head> <tail0> <tail1> <merit>            (binary rule)
+//
+// with edges grouped by head in ascending node order.
+//
+
+#ifndef NLU_CRF_FOREST_IO_H__
+#define NLU_CRF_FOREST_IO_H__
+
+#include <math.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <istream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+inline std::vector<std::string> &split(const std::string &s, char delim,
+                                       std::vector<std::string> &elems) {
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, delim)) {
+      elems.push_back(item);
+  }
+  return elems;
+}
+
+inline std::vector<std::string> split(const std::string &s, char delim) {
+  std::vector<std::string> elems;
+  split(s, delim, elems);
+  return elems;
+}
+
+// read the label list of tcrf rules, return false if the file can not be
+// opened, does not parse or has no labels
+inline bool ReadTcrfLabels(const std::string& path,
+                           std::map<std::string, int>* label_map,
+                           std::vector<std::string>* label_list) {
+  int num_of_labels = 0, num_of_urules, num_of_brules;
+  std::ifstream fin_rule(path.c_str());
+  fin_rule >> num_of_labels;
+  fin_rule >> num_of_urules;
+  fin_rule >> num_of_brules;
+  for (int i = 0; fin_rule && i < num_of_labels; i++) {
+    int idx;
+    float f1, f2;
+    std::string tmp, label;
+    if (!(fin_rule >> tmp >> idx >> label >> f1 >> f2)) {
+      break;
+    }
+    (*label_map)[label] = idx;
+    label_list->push_back(label);
+  }
+  bool parsed = !fin_rule.fail() && num_of_labels > 0;
+  fin_rule.close();
+  return parsed;
+}
+
+// read binary headrules, which map "parent^left^right" to the index of the
+// head child, return false if the file can not be opened, does not parse or
+// has no rules
+inline bool ReadBinaryHeadrules(const std::string& path,
+                                std::map<std::string, int>* binary_headrules) {
+  std::ifstream fin_bhr(path.c_str());
+  int num = 0;
+  fin_bhr >> num;
+  for (int i = 0; fin_bhr && i < num; i++) {
+    std::string brules;
+    int head_idx, count;
+    if (!(fin_bhr >> brules >> head_idx >> count)) {
+      break;
+    }
+    (*binary_headrules)[brules] = head_idx;
+  }
+  bool parsed = !fin_bhr.fail() && num > 0;
+  fin_bhr.close();
+  return parsed;
+}
+
+// Read the tokens and nodes of the next sentence from the prediction file
+// into fs, which is expected to be empty, up to its edges. Leaves get their
+// own span as headword and a basic unit; the headwords of the other nodes are
+// resolved by ReadForestEdge. parsed is set to false for a sentence which
+// failed to parse, which has no nodes nor edges. Return false at the end of
+// the input.
+inline bool ReadForestNodes(std::istream& fin, ForestSentence* fs,
+                            bool* parsed) {
+  int num_of_tokens, num_of_nodes;
+  if (!(fin >> num_of_tokens)) {
+    return false;
+  }
+  for (int i = 0; i < num_of_tokens; i++) {
+    std::string segment;
+    fin >> segment;
+    fs->add_tokens(segment);
+  }
+
+  ParseForest* forest = fs->mutable_forest();
+  fin >> num_of_nodes;
+  *parsed = num_of_nodes != -1;
+  std::string line;
+  std::getline(fin, line);
+  for (int i = 0; i < num_of_nodes; i++) {
+    std::string index;
+    int stt, end, tag, upper, basic_unit;
+    // the scores are optional, as in data/tcrf.predict
+    float inside_score = 0.0, outside_score = 0.0;
+    std::getline(fin, line);
+    std::istringstream fields(line);
+    fields >> index >> stt >> end >> tag >> upper >> basic_unit;
+    fields >> inside_score >> outside_score;
+
+    NodeInfo* node = forest->add_nodes();
+    node->set_start(stt);
+    node->set_end(end);
+    node->set_label(tag);
+    node->set_upper(upper);
+    node->set_basic_unit(basic_unit);
+    node->set_inside_score(inside_score);
+    node->set_outside_score(outside_score);
+
+    if (basic_unit == 1 && upper == 0) {
+      node->set_headword_stt(stt);
+      node->set_headword_end(end);
+      BasicUnit* bu = fs->add_basic_units();
+      bu->set_start(stt);
+      bu->set_end(end);
+    } else {
+      node->set_headword_stt(-1);
+      node->set_headword_end(-1);
+    }
+  }
+  return true;
+}
+
+// Read the number of edges following the nodes, and the rest of its line.
+inline int ReadForestEdgeCount(std::istream& fin) {
+  int num_of_edges = 0;
+  fin >> num_of_edges;
+  std::string line;
+  std::getline(fin, line);
+  return num_of_edges;
+}
+
+// Read the next edge line into edge, and set the headword of its head node in
+// forest from the head child of the edge. The merit is stored as read, in log
+// space, so that no score underflows or overflows before a semiring maps it.
+inline void ReadForestEdge(std::istream& fin,
+                           const std::vector<std::string>& label_list,
+                           const std::map<std::string, int>& binary_headrules,
+                           ParseForest* forest, HyperEdgeInfo* edge) {
+  std::string line;
+  std::getline(fin, line);
+  std::vector<std::string> strs = split(line, ' ');
+  if (strs.size() == 3) {
+    // unary rule
+    int head = std::stoi(strs[0]);
+    int tail = std::stoi(strs[1]);
+    float merit = std::stof(strs[2]);
+
+    NodeInfo* head_node = forest->mutable_nodes(head);
+    NodeInfo* tail_node = forest->mutable_nodes(tail);
+    head_node->set_headword_stt(tail_node->headword_stt());
+    head_node->set_headword_end(tail_node->headword_end());
+
+    edge->set_merit(merit);
+    edge->set_head_idx(head);
+    edge->add_tail_idx(tail);
+  } else {
+    // binary rule
+    int head = std::stoi(strs[0]);
+    int tail0 = std::stoi(strs[1]);
+    int tail1 = std::stoi(strs[2]);
+    float merit = std::stof(strs[3]);
+
+    NodeInfo* head_node = forest->mutable_nodes(head);
+    NodeInfo* tail_node0 = forest->mutable_nodes(tail0);
+    NodeInfo* tail_node1 = forest->mutable_nodes(tail1);
+    std::string rule = label_list[head_node->label()] + "^" +
+                       label_list[tail_node0->label()] + "^" +
+                       label_list[tail_node1->label()];
+    std::map<std::string, int>::const_iterator it =
+        binary_headrules.find(rule);
+    if (it == binary_headrules.end() || it->second == 0) {
+      head_node->set_headword_stt(tail_node0->headword_stt());
+      head_node->set_headword_end(tail_node0->headword_end());
+    }
+    else {
+      head_node->set_headword_stt(tail_node1->headword_stt());
+      head_node->set_headword_end(tail_node1->headword_end());
+    }
+
+    edge->set_merit(merit);
+    edge->set_head_idx(head);
+    edge->add_tail_idx(tail0);
+    edge->add_tail_idx(tail1);
+  }
+}
+
+// Add the starting indexes of the heads after last_head up to head, the head
+// of edge edge_idx, and make it the last head. An edge whose head comes
+// before last_head thus goes to the range of edges being read, and the
+// ranges of the heads after it are added once more.
+inline void AddStartingIndexes(int head, int edge_idx, int* last_head,
+                               ParseForest* forest) {
+  if (head == *last_head) {
+    return;
+  }
+  for (int j = *last_head + 1; j <= head; j++) {
+    forest->add_starting_indexes(edge_idx);
+  }
+  *last_head = head;
+}
+
+// Read the next sentence from the prediction file into fs, which is expected
+// to be empty. Headwords of the nodes are resolved with the binary headrules
+// while reading edges, and merits are stored as read, in log space. A
+// sentence which failed to parse is returned with an empty forest. Return
+// false at the end of the input.
+inline bool ReadForestSentence(std::istream& fin,
+                               const std::vector<std::string>& label_list,
+                               const std::map<std::string, int>& binary_headrules,
+                               ForestSentence* fs) {
+  bool parsed;
+  if (!ReadForestNodes(fin, fs, &parsed)) {
+    return false;
+  }
+  if (!parsed) {
+    return true;
+  }
+
+  ParseForest* forest = fs->mutable_forest();
+  int last_head = -1;
+  int num_of_edges = ReadForestEdgeCount(fin);
+  for (int i = 0; i < num_of_edges; i++) {
+    HyperEdgeInfo* edge = forest->add_edges();
+    ReadForestEdge(fin, label_list, binary_headrules, forest, edge);
+    AddStartingIndexes(edge->head_idx(), i, &last_head, forest);
+  }
+  forest->add_starting_indexes(num_of_edges);
+  return true;
+}
+
+// Write fs in the prediction format, so that it can be read back with
+// ReadForestSentence. Scores and log merits are written with all their digits,
+// so that a forest as read is read back exactly.
+inline void WriteForestSentence(FILE* out, const ForestSentence& fs) {
+  fprintf(out, "%d\n", fs.tokens_size());
+  for (int i = 0; i < fs.tokens_size(); i++) {
+    fprintf(out, "%s\n", fs.tokens(i).c_str());
+  }
+  const ParseForest& forest = fs.forest();
+  if (forest.nodes_size() == 0) {
+    fprintf(out, "-1\n");
+    return;
+  }
+  fprintf(out, "%d\n", forest.nodes_size());
+  for (int i = 0; i < forest.nodes_size(); i++) {
+    const NodeInfo& node = forest.nodes(i);
+    fprintf(out, "%d: %d %d %d %d %d %.17g %.17g\n", i, node.start(),
+            node.end(), node.label(), node.upper(), node.basic_unit(),
+            node.inside_score(), node.outside_score());
+  }
+  fprintf(out, "%d\n", forest.edges_size());
+  for (int i = 0; i < forest.edges_size(); i++) {
+    const HyperEdgeInfo& edge = forest.edges(i);
+    fprintf(out, "%d", edge.head_idx());
+    for (int k = 0; k < edge.tail_idx_size(); k++) {
+      fprintf(out, " %d", edge.tail_idx(k));
+    }
+    fprintf(out, " %.17g\n", edge.merit());
+  }
+}
+
+} // namespace nlu
+
+#endif
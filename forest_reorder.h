@@ -0,0 +1,148 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Reordering of the nodes of a parse forest for locality of GovernorFinder.
+//
+// GovernorFinder computes the nodes in index order, reading the cells of the
+// tails of their edges. In span-length order the children of a node are
+// spread over the whole chart, so the nodes are renumbered in the post-order
+// of a depth-first walk from the top node: each node comes right after the
+// subforests of its tails, and the edges are laid out contiguously in the new
+// order of their heads.
+//
+// The new order computes every node at the same time relative to the nodes it
+// reads as the old one: a tail before its head stays before it, and a tail
+// which is not a leaf and comes after its head (an upper node of the same
+// span), whose cells are still empty when the head is computed, stays after
+// it. So the cells, and the order of the markups within them, are unchanged.
+//
+
+#ifndef NLU_CRF_FOREST_REORDER_H__
+#define NLU_CRF_FOREST_REORDER_H__
+
+#include <utility>
+#include <vector>
+
+#include "forest_simplifier.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+struct ForestPermutation {
+  // new index of every original node, and original index of every new node
+  std::vector<int> new_of_old;
+  std::vector<int> old_of_new;
+};
+
+// Renumber the nodes, edges and starting_indexes of the forest for locality
+// as described above, keeping the top node last, and return the permutation
+// of the nodes.
+inline ForestPermutation ReorderForest(ForestSentence* fs) {
+  ForestPermutation permutation;
+  const ParseForest& forest = fs->forest();
+  int num_of_nodes = forest.nodes_size();
+  if (num_of_nodes == 0 || forest.starting_indexes_size() <= num_of_nodes) {
+    for (int i = 0; i < num_of_nodes; i++) {
+      permutation.new_of_old.push_back(i);
+      permutation.old_of_new.push_back(i);
+    }
+    return permutation;
+  }
+
+  // nodes which have to come before every node: the tails it reads, and the
+  // heads which read it before it is computed
+  std::vector<std::vector<int> > before(num_of_nodes);
+  for (int i = 0; i < num_of_nodes; i++) {
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        int t = edge.tail_idx(k);
+        if (t < i || IsLeafNode(forest.nodes(t))) {
+          before[i].push_back(t);
+        } else if (t > i) {
+          before[t].push_back(i);
+        }
+      }
+    }
+  }
+
+  // post-order from the tails of the top node, then the nodes the top node
+  // does not depend on, and the top node last
+  int top = num_of_nodes - 1;
+  std::vector<bool> visited(num_of_nodes, false);
+  visited[top] = true;
+  std::vector<std::pair<int, size_t> > stack;
+  std::vector<int> roots = before[top];
+  for (int i = 0; i < top; i++) {
+    roots.push_back(i);
+  }
+  for (size_t r = 0; r < roots.size(); r++) {
+    if (visited[roots[r]]) {
+      continue;
+    }
+    visited[roots[r]] = true;
+    stack.push_back(std::make_pair(roots[r], 0));
+    while (!stack.empty()) {
+      int i = stack.back().first;
+      size_t next = stack.back().second;
+      if (next < before[i].size()) {
+        stack.back().second++;
+        int p = before[i][next];
+        if (!visited[p]) {
+          visited[p] = true;
+          stack.push_back(std::make_pair(p, 0));
+        }
+        continue;
+      }
+      stack.pop_back();
+      permutation.old_of_new.push_back(i);
+    }
+  }
+  permutation.old_of_new.push_back(top);
+
+  permutation.new_of_old.resize(num_of_nodes);
+  for (int i = 0; i < num_of_nodes; i++) {
+    permutation.new_of_old[permutation.old_of_new[i]] = i;
+  }
+
+  ParseForest reordered;
+  reordered.set_logz(forest.logz());
+  reordered.set_num_of_top_nodes(forest.num_of_top_nodes());
+  for (int n = 0; n < num_of_nodes; n++) {
+    int i = permutation.old_of_new[n];
+    reordered.add_nodes()->CopyFrom(forest.nodes(i));
+    reordered.add_starting_indexes(reordered.edges_size());
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      HyperEdgeInfo* new_edge = reordered.add_edges();
+      new_edge->set_merit(edge.merit());
+      new_edge->set_head_idx(n);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        new_edge->add_tail_idx(permutation.new_of_old[edge.tail_idx(k)]);
+      }
+    }
+  }
+  reordered.add_starting_indexes(reordered.edges_size());
+
+  fs->mutable_forest()->Swap(&reordered);
+  return permutation;
+}
+
+// Per node values (e.g. GovernorFinder::GetGovernors()) of the reordered
+// forest, in the original order of the nodes.
+template <class T>
+std::vector<T> ToOriginalNodeOrder(const ForestPermutation& permutation,
+                                   const std::vector<T>& values) {
+  std::vector<T> result(values.size());
+  for (size_t n = 0; n < values.size(); n++) {
+    result[permutation.old_of_new[n]] = values[n];
+  }
+  return result;
+}
+
+} // namespace nlu
+
+#endif
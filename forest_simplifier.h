@@ -0,0 +1,213 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Simplification of a parse forest before computing expected governors.
+//
+// Only the governors of the top node (the last one) are used, so nodes which
+// can not be reached from it are pure wasted work. Hyper edges sharing the
+// same head and tails produce exactly the same governor markups, so they can
+// be merged into a single edge whose merit is the sum of their merits, added
+// in log space as the merits are log merits. Under the max-product semiring
+// only the best of them counts, so the merged merit is their maximum.
+//
+// A node B whose only edge is a unary B -> C keeping the headword has the
+// same cells as C, since the markups are copied and the merit is normalized
+// away. Its parents can use C directly, unless they would write the label of
+// B into a markup, skipping the propagation through B.
+//
+
+#ifndef NLU_CRF_FOREST_SIMPLIFIER_H__
+#define NLU_CRF_FOREST_SIMPLIFIER_H__
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+#include "expected_governor.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+inline bool IsLeafNode(const NodeInfo& node) {
+  return node.basic_unit() == 1 && node.upper() == 0;
+}
+
+struct SimplifyStats {
+  int removed_nodes;
+  int removed_edges;
+  int merged_edges;
+
+  SimplifyStats() : removed_nodes(0), removed_edges(0), merged_edges(0) {}
+};
+
+// Remove nodes and edges not reachable from the top node, merge duplicate
+// hyper edges, and compact node indexes and starting_indexes accordingly.
+// The relative order of the remaining nodes is preserved, so the forest stays
+// sorted by the length of the span and the top node stays the last one.
+// Duplicate edges are merged into the sum of their merits, or into their
+// maximum with max_merits, for MaxProductSemiring.
+inline SimplifyStats SimplifyForest(ForestSentence* fs,
+                                    bool max_merits = false) {
+  SimplifyStats stats;
+  const ParseForest& forest = fs->forest();
+  int num_of_nodes = forest.nodes_size();
+  if (num_of_nodes == 0) {
+    return stats;
+  }
+
+  // mark nodes reachable from the top node
+  std::vector<bool> reachable(num_of_nodes, false);
+  std::vector<int> stack;
+  reachable[num_of_nodes - 1] = true;
+  stack.push_back(num_of_nodes - 1);
+  while (!stack.empty()) {
+    int i = stack.back();
+    stack.pop_back();
+    if (i + 1 >= forest.starting_indexes_size()) {
+      continue;
+    }
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        if (!reachable[edge.tail_idx(k)]) {
+          reachable[edge.tail_idx(k)] = true;
+          stack.push_back(edge.tail_idx(k));
+        }
+      }
+    }
+  }
+
+  std::vector<int> new_idx(num_of_nodes, -1);
+  int num_of_kept_nodes = 0;
+  for (int i = 0; i < num_of_nodes; i++) {
+    if (reachable[i]) {
+      new_idx[i] = num_of_kept_nodes++;
+    }
+  }
+
+  ParseForest simplified;
+  simplified.set_logz(forest.logz());
+  simplified.set_num_of_top_nodes(forest.num_of_top_nodes());
+  for (int i = 0; i < num_of_nodes; i++) {
+    if (!reachable[i]) {
+      stats.removed_nodes++;
+      if (i + 1 < forest.starting_indexes_size()) {
+        stats.removed_edges +=
+            forest.starting_indexes(i+1) - forest.starting_indexes(i);
+      }
+      continue;
+    }
+    simplified.add_nodes()->CopyFrom(forest.nodes(i));
+    simplified.add_starting_indexes(simplified.edges_size());
+    if (i + 1 >= forest.starting_indexes_size()) {
+      continue;
+    }
+    // edges of a head are contiguous, so duplicates only need to be looked
+    // up among the edges of the same head
+    std::map<std::vector<int>, int> edge_of_tails;
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      std::vector<int> tails;
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        tails.push_back(new_idx[edge.tail_idx(k)]);
+      }
+      std::map<std::vector<int>, int>::iterator it = edge_of_tails.find(tails);
+      if (it != edge_of_tails.end()) {
+        HyperEdgeInfo* merged = simplified.mutable_edges(it->second);
+        if (max_merits) {
+          merged->set_merit(std::max(merged->merit(), edge.merit()));
+        } else {
+          merged->set_merit(LogSemiring::Plus(merged->merit(), edge.merit()));
+        }
+        stats.merged_edges++;
+        continue;
+      }
+      edge_of_tails[tails] = simplified.edges_size();
+      HyperEdgeInfo* new_edge = simplified.add_edges();
+      new_edge->set_merit(edge.merit());
+      new_edge->set_head_idx(new_idx[i]);
+      for (size_t k = 0; k < tails.size(); k++) {
+        new_edge->add_tail_idx(tails[k]);
+      }
+    }
+  }
+  simplified.add_starting_indexes(simplified.edges_size());
+
+  fs->mutable_forest()->Swap(&simplified);
+  return stats;
+}
+
+// Redirect the tails of the edges to the end of the chain of unary edges
+// keeping the headword below them, and return the number of tails
+// redirected. A tail B is replaced by C when B is not a leaf, its only edge
+// is B -> C with a finite log merit, B and C have the same headword, and C is
+// computed before B (it is a leaf or comes first); the parent, i.e. the node
+// computing the edge, must come after B, and either share the headword of B
+// or B and C must have the same label, so that the markups written for the
+// parent do not change. Governor changing unary edges such as START_SYMBOL
+// -> S are kept. The merit of the parent edge is kept as is: the merits of
+// B -> C are normalized away in the cells of B, up to float rounding. Run
+// SimplifyForest afterwards to drop the bypassed nodes.
+inline int CollapseUnaryChains(ParseForest* forest) {
+  int num_of_nodes = forest->nodes_size();
+  if (forest->starting_indexes_size() <= num_of_nodes) {
+    return 0;
+  }
+  // the node at the end of the collapsible chain below every node
+  std::vector<int> target(num_of_nodes);
+  for (int i = 0; i < num_of_nodes; i++) {
+    target[i] = i;
+  }
+  for (int i = 0; i < num_of_nodes; i++) {
+    const NodeInfo& node = forest->nodes(i);
+    int begin = forest->starting_indexes(i);
+    if (IsLeafNode(node) || forest->starting_indexes(i+1) - begin != 1) {
+      continue;
+    }
+    const HyperEdgeInfo& edge = forest->edges(begin);
+    if (edge.tail_idx_size() != 1 || !std::isfinite(edge.merit())) {
+      continue;
+    }
+    int c = edge.tail_idx(0);
+    const NodeInfo& child = forest->nodes(c);
+    if ((c < i || IsLeafNode(child))
+        && child.headword_stt() == node.headword_stt()
+        && child.headword_end() == node.headword_end()) {
+      target[i] = target[c];
+    }
+  }
+
+  // the parent of an edge is the node whose range of edges holds it, which
+  // is not its head_idx for an edge listed after the edges of a later head
+  int redirected = 0;
+  for (int i = 0; i < num_of_nodes; i++) {
+    const NodeInfo& parent = forest->nodes(i);
+    for (int j = forest->starting_indexes(i);
+         j < forest->starting_indexes(i+1); j++) {
+      HyperEdgeInfo* edge = forest->mutable_edges(j);
+      for (int k = 0; k < edge->tail_idx_size(); k++) {
+        int t = edge->tail_idx(k);
+        if (target[t] == t || t > i) {
+          continue;
+        }
+        const NodeInfo& child = forest->nodes(t);
+        if ((child.headword_stt() != parent.headword_stt()
+             || child.headword_end() != parent.headword_end())
+            && child.label() != forest->nodes(target[t]).label()) {
+          continue;
+        }
+        edge->set_tail_idx(k, target[t]);
+        redirected++;
+      }
+    }
+  }
+  return redirected;
+}
+
+} // namespace nlu
+
+#endif
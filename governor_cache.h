@@ -0,0 +1,265 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Bounded LRU cache of expected governors of the top node, keyed by a 128 bit
+// hash of the canonicalized forest sentence.
+//
+// Repeated input text (templates, retried requests, ...) produces identical
+// forests, and looking the result up is much cheaper than running
+// GovernorFinder again.
+//
+
+#ifndef NLU_CRF_GOVERNOR_CACHE_H__
+#define NLU_CRF_GOVERNOR_CACHE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expected_governor.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+struct ForestKey {
+  uint64_t hi;
+  uint64_t lo;
+};
+
+inline bool operator==(const ForestKey& lhs, const ForestKey& rhs) {
+  return lhs.hi == rhs.hi && lhs.lo == rhs.lo;
+}
+
+struct ForestKeyHash {
+  size_t operator()(const ForestKey& key) const {
+    return static_cast<size_t>(key.lo);
+  }
+};
+
+// Two independent 64 bit lanes over a stream of 64 bit words. Every field is
+// fed with a fixed layout (strings are length prefixed), so the key does not
+// depend on how the protobuf message happens to be serialized.
+class ForestHasher {
+ public:
+  ForestHasher() : h1(0x9e3779b97f4a7c15ULL), h2(0xc2b2ae3d27d4eb4fULL),
+                   words(0) {}
+
+  void Add(uint64_t v) {
+    h1 = Mix(h1 ^ v) * 0xff51afd7ed558ccdULL;
+    h2 = Rotate(h2 + v * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+    h2 ^= h1 >> 27;
+    words++;
+  }
+
+  void AddInt(int v) { Add(static_cast<uint64_t>(static_cast<int64_t>(v))); }
+
+  void AddFloat(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    Add(bits);
+  }
+
+  void AddString(const std::string& s) {
+    Add(s.size());
+    for (size_t i = 0; i < s.size(); i += 8) {
+      uint64_t word = 0;
+      memcpy(&word, s.data() + i, std::min<size_t>(8, s.size() - i));
+      Add(word);
+    }
+  }
+
+  ForestKey Finish() const {
+    ForestKey key;
+    key.hi = Mix(h1 ^ Rotate(h2, 17) ^ words);
+    key.lo = Mix(h2 ^ Rotate(h1, 41) ^ (words * 0x9e3779b97f4a7c15ULL));
+    return key;
+  }
+
+ private:
+  static uint64_t Rotate(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+  }
+
+  // finalizer of MurmurHash3
+  static uint64_t Mix(uint64_t v) {
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ULL;
+    v ^= v >> 33;
+    return v;
+  }
+
+  uint64_t h1;
+  uint64_t h2;
+  uint64_t words;
+};
+
+// hash tokens, basic units, node labels/spans/headwords, edges and merits
+inline ForestKey HashForestSentence(const ForestSentence& fs) {
+  ForestHasher hasher;
+  hasher.AddInt(fs.tokens_size());
+  for (int i = 0; i < fs.tokens_size(); i++) {
+    hasher.AddString(fs.tokens(i));
+  }
+  hasher.AddInt(fs.basic_units_size());
+  for (int i = 0; i < fs.basic_units_size(); i++) {
+    hasher.AddInt(fs.basic_units(i).start());
+    hasher.AddInt(fs.basic_units(i).end());
+  }
+  const ParseForest& forest = fs.forest();
+  hasher.AddInt(forest.nodes_size());
+  for (int i = 0; i < forest.nodes_size(); i++) {
+    const NodeInfo& node = forest.nodes(i);
+    hasher.AddInt(node.start());
+    hasher.AddInt(node.end());
+    hasher.AddInt(node.label());
+    hasher.AddInt(node.upper());
+    hasher.AddInt(node.basic_unit());
+    hasher.AddInt(node.headword_stt());
+    hasher.AddInt(node.headword_end());
+  }
+  hasher.AddInt(forest.starting_indexes_size());
+  for (int i = 0; i < forest.starting_indexes_size(); i++) {
+    hasher.AddInt(forest.starting_indexes(i));
+  }
+  hasher.AddInt(forest.edges_size());
+  for (int i = 0; i < forest.edges_size(); i++) {
+    const HyperEdgeInfo& edge = forest.edges(i);
+    hasher.AddInt(edge.head_idx());
+    hasher.AddInt(edge.tail_idx_size());
+    for (int k = 0; k < edge.tail_idx_size(); k++) {
+      hasher.AddInt(edge.tail_idx(k));
+    }
+    hasher.AddFloat(edge.merit());
+  }
+  return hasher.Finish();
+}
+
+// Thread safe, so that one cache can be shared by several workers.
+class GovernorCache {
+ public:
+  explicit GovernorCache(size_t max_bytes)
+    : max_bytes_(max_bytes), bytes_(0), hits_(0), misses_(0),
+      evictions_(0) {}
+
+  // Copy the cached governors of the top node into result and mark the entry
+  // as most recently used. Return false on a miss.
+  bool Lookup(const ForestKey& key, std::vector<GovernorsPerWord>* result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Index::iterator it = index_.find(key);
+    if (it == index_.end()) {
+      misses_++;
+      return false;
+    }
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    *result = it->second->governors;
+    return true;
+  }
+
+  // Insert the governors of the top node, evicting least recently used
+  // entries until the cache fits in max_bytes again. Results larger than the
+  // whole budget are not cached.
+  void Insert(const ForestKey& key,
+              const std::vector<GovernorsPerWord>& governors) {
+    size_t bytes = EstimateBytes(governors);
+    if (bytes > max_bytes_) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.find(key) != index_.end()) {
+      return;
+    }
+    Entry entry;
+    entry.key = key;
+    entry.governors = governors;
+    entry.bytes = bytes;
+    entries_.push_front(entry);
+    index_[key] = entries_.begin();
+    bytes_ += bytes;
+    while (bytes_ > max_bytes_) {
+      const Entry& last = entries_.back();
+      bytes_ -= last.bytes;
+      index_.erase(last.key);
+      entries_.pop_back();
+      evictions_++;
+    }
+  }
+
+  // drop every entry, e.g. once they are no longer valid
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+
+  uint64_t hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+  }
+
+  uint64_t misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+  }
+
+  uint64_t evictions() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return evictions_;
+  }
+
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+ private:
+  struct Entry {
+    ForestKey key;
+    std::vector<GovernorsPerWord> governors;
+    size_t bytes;
+  };
+  typedef std::list<Entry> EntryList;
+  typedef std::unordered_map<ForestKey, EntryList::iterator,
+                             ForestKeyHash> Index;
+
+  static size_t EstimateBytes(const std::vector<GovernorsPerWord>& governors) {
+    // list node, hash table node and the entry itself
+    size_t bytes = sizeof(Entry) + 4 * sizeof(void*) + sizeof(ForestKey);
+    for (size_t i = 0; i < governors.size(); i++) {
+      bytes += sizeof(GovernorsPerWord);
+      for (size_t j = 0; j < governors[i].gms.size(); j++) {
+        bytes += sizeof(GovernorMarkup)
+                 + governors[i].gms[j].headword_parent_of_u.capacity();
+      }
+    }
+    return bytes;
+  }
+
+  size_t max_bytes_;
+  size_t bytes_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+  EntryList entries_;
+  Index index_;
+  mutable std::mutex mutex_;
+};
+
+} // namespace nlu
+
+#endif
@@ -0,0 +1,194 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Expected counts of governor markups (label_u, label_parent_of_u,
+// headword_parent_of_u) over a corpus, accumulated from the governors of the
+// top node of every sentence instead of writing them out one sentence at a
+// time. Tables filled independently (e.g. one per thread or per shard of the
+// corpus) are combined with Merge.
+//
+// Markups hold label indexes of the grammar they were computed with, which a
+// reloaded grammar may number differently, so the table keeps labels by name:
+// SetLabels tells it the labels of the grammar of the following Adds.
+//
+
+#ifndef NLU_CRF_GOVERNOR_COUNTS_H__
+#define NLU_CRF_GOVERNOR_COUNTS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "expected_governor.h"
+
+namespace nlu {
+
+struct GovernorCountKey {
+  int label_u;
+  int label_parent_of_u;
+  std::string headword_parent_of_u;
+};
+
+inline bool operator==(const GovernorCountKey& lhs,
+                       const GovernorCountKey& rhs) {
+  return lhs.label_u == rhs.label_u
+         && lhs.label_parent_of_u == rhs.label_parent_of_u
+         && lhs.headword_parent_of_u == rhs.headword_parent_of_u;
+}
+
+struct GovernorCountKeyHash {
+  size_t operator()(const GovernorCountKey& key) const {
+    uint64_t h = std::hash<std::string>()(key.headword_parent_of_u);
+    h ^= (static_cast<uint64_t>(static_cast<uint32_t>(key.label_u)) << 32
+          | static_cast<uint32_t>(key.label_parent_of_u))
+         * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 29));
+  }
+};
+
+class GovernorCountTable {
+ public:
+  GovernorCountTable() : sentences(0) {}
+
+  // name the label indexes of the markups added from now on
+  void SetLabels(const std::vector<std::string>& label_list) {
+    grammar_labels.resize(label_list.size());
+    for (size_t i = 0; i < label_list.size(); i++) {
+      grammar_labels[i] = labelId(label_list[i]);
+    }
+  }
+
+  // add the expected counts of the governors of the top node of a sentence
+  void Add(const std::vector<GovernorsPerWord>& governors) {
+    for (size_t i = 0; i < governors.size(); i++) {
+      for (size_t j = 0; j < governors[i].gms.size(); j++) {
+        const GovernorMarkup& m = governors[i].gms[j];
+        key.label_u = grammarLabel(m.label_u);
+        key.label_parent_of_u = grammarLabel(m.label_parent_of_u);
+        key.headword_parent_of_u = m.headword_parent_of_u;
+        counts[key] += m.probability;
+      }
+    }
+    sentences++;
+  }
+
+  // add the counts of another table to this one
+  void Merge(const GovernorCountTable& other) {
+    std::vector<int> other_labels(other.labels.size());
+    for (size_t i = 0; i < other.labels.size(); i++) {
+      other_labels[i] = labelId(other.labels[i]);
+    }
+    CountMap::const_iterator it = other.counts.begin();
+    for (; it != other.counts.end(); ++it) {
+      key = it->first;
+      if (key.label_u != -1) {
+        key.label_u = other_labels[key.label_u];
+      }
+      if (key.label_parent_of_u != -1) {
+        key.label_parent_of_u = other_labels[key.label_parent_of_u];
+      }
+      counts[key] += it->second;
+    }
+    sentences += other.sentences;
+  }
+
+  // Write "label_u label_parent_of_u headword_parent_of_u count" lines,
+  // with labels named as in the per-sentence output, sorted by these names
+  // and then by headword so that the file does not depend on how the table
+  // was filled, nor on the grammars it was filled with.
+  void Write(FILE* out) const {
+    static const std::string root("ROOT"), none("NONE");
+    std::vector<Entry> entries;
+    CountMap::const_iterator it = counts.begin();
+    for (; it != counts.end(); ++it) {
+      Entry entry;
+      entry.label_u = labelName(it->first.label_u, &root);
+      entry.label_parent_of_u = labelName(it->first.label_parent_of_u,
+                                          &none);
+      entry.headword_parent_of_u = &it->first.headword_parent_of_u;
+      entry.count = it->second;
+      entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), EntryLess);
+    for (size_t i = 0; i < entries.size(); i++) {
+      fprintf(out, "%s %s %s %f\n", entries[i].label_u->c_str(),
+              entries[i].label_parent_of_u->c_str(),
+              entries[i].headword_parent_of_u->c_str(), entries[i].count);
+    }
+  }
+
+  // number of distinct markups
+  size_t size() const {
+    return counts.size();
+  }
+
+  // number of sentences added, including those of merged tables
+  long long num_of_sentences() const {
+    return sentences;
+  }
+
+ private:
+  typedef std::unordered_map<GovernorCountKey, double, GovernorCountKeyHash>
+      CountMap;
+
+  // a line of Write, pointing into the table
+  struct Entry {
+    const std::string* label_u;
+    const std::string* label_parent_of_u;
+    const std::string* headword_parent_of_u;
+    double count;
+  };
+
+  static bool EntryLess(const Entry& lhs, const Entry& rhs) {
+    if (*lhs.label_u != *rhs.label_u) {
+      return *lhs.label_u < *rhs.label_u;
+    }
+    if (*lhs.label_parent_of_u != *rhs.label_parent_of_u) {
+      return *lhs.label_parent_of_u < *rhs.label_parent_of_u;
+    }
+    return *lhs.headword_parent_of_u < *rhs.headword_parent_of_u;
+  }
+
+  // the id of a label name in this table, added if new
+  int labelId(const std::string& name) {
+    std::map<std::string, int>::const_iterator it = label_ids.find(name);
+    if (it != label_ids.end()) {
+      return it->second;
+    }
+    label_ids[name] = static_cast<int>(labels.size());
+    labels.push_back(name);
+    return static_cast<int>(labels.size()) - 1;
+  }
+
+  // the id in this table of a label index of the current grammar
+  int grammarLabel(int label) const {
+    return label == -1 ? -1 : grammar_labels[label];
+  }
+
+  // the name of an id, or none for -1
+  const std::string* labelName(int id, const std::string* none) const {
+    return id == -1 ? none : &labels[id];
+  }
+
+  CountMap counts;
+  long long sentences;
+  // names of the labels of the keys, by id, and their ids
+  std::vector<std::string> labels;
+  std::map<std::string, int> label_ids;
+  // ids of the label indexes of the grammar set by SetLabels
+  std::vector<int> grammar_labels;
+  // reused by Add and Merge to avoid allocating the headword of every markup
+  GovernorCountKey key;
+};
+
+} // namespace nlu
+
+#endif
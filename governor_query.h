@@ -0,0 +1,183 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Expected governors of a few basic units of the top node, without the chart
+// of the whole sentence.
+//
+// The cells of a basic unit only ever read cells of the same basic unit, so
+// each queried column is computed on its own, in the order GovernorFinder
+// computes the nodes, following only the tails which have markups for the
+// basic unit. Nodes are not filtered by span: a node computed with the edges
+// of other heads (see ReadForestSentence) may get markups of a basic unit
+// outside its span. The lists of the nodes reading each node through a tail
+// are built once, so that a column only visits the nodes reachable from the
+// leaf of its basic unit, and their edges: the work is that of the queried
+// columns of GovernorFinder, about |query| / basic_units_size() of the full
+// chart.
+//
+
+#ifndef NLU_CRF_GOVERNOR_QUERY_H__
+#define NLU_CRF_GOVERNOR_QUERY_H__
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "best_derivation.h"
+#include "expected_governor.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+template <class Semiring>
+class GovernorQueryT {
+ public:
+  // compute the governors of the basic units with the given indexes
+  GovernorQueryT(const ForestSentence* forestSentence,
+                 const std::vector<int>& basic_units)
+    : fs(forestSentence), visited_nodes(0) {
+    const ParseForest& forest = fs->forest();
+    readers.resize(forest.nodes_size());
+    leaves_of.resize(fs->basic_units_size());
+    for (int i = 0; i < forest.nodes_size(); i++) {
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        for (int c = 0; c < edge.tail_idx_size(); c++) {
+          std::vector<int>& r = readers[edge.tail_idx(c)];
+          if (r.empty() || r.back() != i) {
+            r.push_back(i);
+          }
+        }
+      }
+      int bu_idx = LeafBasicUnit(*fs, forest.nodes(i));
+      if (bu_idx >= 0) {
+        leaves_of[bu_idx].push_back(i);
+      }
+    }
+    cells.resize(forest.nodes_size());
+    in_column.assign(forest.nodes_size(), false);
+    for (size_t q = 0; q < basic_units.size(); q++) {
+      GovernorsPerWord gpw;
+      gpw.idx = basic_units[q];
+      computeColumn(basic_units[q], &gpw.gms);
+      result.push_back(gpw);
+    }
+  }
+
+  // governors of the queried basic units of the top node, in the order of
+  // the query, with GovernorsPerWord::idx the index of the basic unit
+  std::vector<GovernorsPerWord> GetGovernors() const {
+    std::vector<GovernorsPerWord> governors = result;
+    for (size_t q = 0; q < governors.size(); q++) {
+      for (size_t k = 0; k < governors[q].gms.size(); k++) {
+        GovernorMarkup& m = governors[q].gms[k];
+        m.probability = Semiring::ToProbability(m.probability);
+      }
+    }
+    return governors;
+  }
+
+  // number of (node, basic unit) cells computed over all queried columns
+  long long VisitedNodes() const {
+    return visited_nodes;
+  }
+
+ private:
+  // compute the cells of basic unit bu_idx of the nodes containing it, and
+  // keep the one of the top node
+  void computeColumn(int bu_idx, std::vector<GovernorMarkup>* top) {
+    const ParseForest& forest = fs->forest();
+    int num_of_nodes = forest.nodes_size();
+    if (num_of_nodes == 0) {
+      return;
+    }
+    // the nodes reachable from the leaves of the basic unit, which, as in
+    // GovernorFinder, are the only ones to get its initial markup
+    column.clear();
+    for (size_t l = 0; l < leaves_of[bu_idx].size(); l++) {
+      int i = leaves_of[bu_idx][l];
+      GovernorMarkup m;
+      m.probability = Semiring::One();
+      cells[i].push_back(m);
+      in_column[i] = true;
+      column.push_back(i);
+    }
+    for (size_t o = 0; o < column.size(); o++) {
+      const std::vector<int>& r = readers[column[o]];
+      for (size_t k = 0; k < r.size(); k++) {
+        if (!in_column[r[k]]) {
+          in_column[r[k]] = true;
+          column.push_back(r[k]);
+        }
+      }
+    }
+    std::sort(column.begin(), column.end());
+
+    for (size_t o = 0; o < column.size(); o++) {
+      int i = column[o];
+      bool reached = false;
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        float weight = Semiring::FromLogMerit(edge.merit());
+        for (int c = 0; c < edge.tail_idx_size(); c++) {
+          if (!cells[edge.tail_idx(c)].empty()) {
+            updateGovernorGivenChild(i, edge.tail_idx(c),
+                                     edge.tail_idx_size() == 2, weight);
+            reached = true;
+          }
+        }
+      }
+      // a cell only holding the initial markup of a leaf is normalized
+      if (reached) {
+        Semiring::Normalize(&cells[i]);
+        visited_nodes++;
+      }
+    }
+    if (in_column[num_of_nodes - 1]) {
+      top->swap(cells[num_of_nodes - 1]);
+    }
+    for (size_t o = 0; o < column.size(); o++) {
+      cells[column[o]].clear();
+      in_column[column[o]] = false;
+    }
+  }
+
+  // same as GovernorFinderT::updateGovernorGivenChild, on the current column
+  void updateGovernorGivenChild(int pidx, int cidx, bool binary_rule,
+                                float weight) {
+    const NodeInfo& parent = fs->forest().nodes(pidx);
+    const NodeInfo& child = fs->forest().nodes(cidx);
+    const std::vector<GovernorMarkup>& child_gms = cells[cidx];
+    std::string headword;
+    if (!SameHeadword(child, parent)) {
+      headword = HeadwordOf(*fs, parent);
+    }
+    GovernorMarkup m;
+    for (size_t i = 0; i < child_gms.size(); i++) {
+      PropagateMarkup(child, parent, binary_rule, headword, child_gms[i], &m);
+      m.probability = Semiring::Times(child_gms[i].probability, weight);
+      AddMarkup<Semiring>(m, &cells[pidx]);
+    }
+  }
+
+  const ForestSentence* fs;
+  long long visited_nodes;
+  // nodes with an edge reading a node as a tail, by node
+  std::vector<std::vector<int> > readers;
+  // leaf nodes of a basic unit, by basic unit
+  std::vector<std::vector<int> > leaves_of;
+  // cells of the column being computed, by node, and the nodes of the column
+  std::vector<std::vector<GovernorMarkup> > cells;
+  std::vector<bool> in_column;
+  std::vector<int> column;
+  std::vector<GovernorsPerWord> result;
+};
+
+typedef GovernorQueryT<ProbabilitySemiring> GovernorQuery;
+
+} // namespace nlu
+
+#endif
@@ -0,0 +1,122 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// The grammar a prediction file is read with (the labels of the tcrf rules
+// and the binary head rules), as an immutable object shared by reference
+// count, and a registry of named grammars which can be replaced at any time.
+//
+// A request takes the current grammar from the registry once and keeps its
+// shared_ptr until it is done, so a grammar replaced in the meantime stays
+// alive until the last request using it finishes, while new requests get the
+// new one. Several grammars can be registered side by side under different
+// names, e.g. the current and the next model during a rollout.
+//
+
+#ifndef NLU_CRF_GRAMMAR_H__
+#define NLU_CRF_GRAMMAR_H__
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "forest_io.h"
+
+namespace nlu {
+
+class Grammar {
+ public:
+  // Read the labels of the tcrf rules and the binary head rules, or return
+  // an empty pointer if either file can not be opened, does not parse or is
+  // empty, e.g. while it is being rewritten.
+  static std::shared_ptr<const Grammar> Load(
+      const std::string& rule_path, const std::string& headrules_path) {
+    std::shared_ptr<Grammar> grammar(new Grammar);
+    if (!ReadTcrfLabels(rule_path, &grammar->label_map_,
+                        &grammar->label_list_)
+        || !ReadBinaryHeadrules(headrules_path,
+                                &grammar->binary_headrules_)) {
+      return std::shared_ptr<const Grammar>();
+    }
+    return grammar;
+  }
+
+  const std::vector<std::string>& label_list() const {
+    return label_list_;
+  }
+
+  const std::map<std::string, int>& label_map() const {
+    return label_map_;
+  }
+
+  const std::map<std::string, int>& binary_headrules() const {
+    return binary_headrules_;
+  }
+
+ private:
+  Grammar() {}
+
+  std::map<std::string, int> label_map_;
+  std::vector<std::string> label_list_;
+  std::map<std::string, int> binary_headrules_;
+};
+
+// Thread safe, so that grammars can be replaced while workers read others.
+class GrammarRegistry {
+ public:
+  // the grammar registered under name, or an empty pointer
+  std::shared_ptr<const Grammar> Get(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    GrammarMap::const_iterator it = grammars_.find(name);
+    return it == grammars_.end() ? std::shared_ptr<const Grammar>()
+                                 : it->second;
+  }
+
+  // register grammar under name, replacing the previous one
+  void Set(const std::string& name,
+           const std::shared_ptr<const Grammar>& grammar) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    grammars_[name] = grammar;
+  }
+
+  // Load a grammar and register it under name. On failure the previous
+  // grammar of that name stays registered, and false is returned.
+  bool Load(const std::string& name, const std::string& rule_path,
+            const std::string& headrules_path) {
+    std::shared_ptr<const Grammar> grammar =
+        Grammar::Load(rule_path, headrules_path);
+    if (!grammar) {
+      return false;
+    }
+    Set(name, grammar);
+    return true;
+  }
+
+  // unregister the grammar of name, return false if there was none
+  bool Remove(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return grammars_.erase(name) > 0;
+  }
+
+  std::vector<std::string> Names() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> names;
+    GrammarMap::const_iterator it = grammars_.begin();
+    for (; it != grammars_.end(); ++it) {
+      names.push_back(it->first);
+    }
+    return names;
+  }
+
+ private:
+  typedef std::map<std::string, std::shared_ptr<const Grammar> > GrammarMap;
+
+  GrammarMap grammars_;
+  mutable std::mutex mutex_;
+};
+
+} // namespace nlu
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Re-run GovernorFinder on sentences captured by find_expected_governor with
+// --slow_sentence_ms, e.g.
+//
+//   perf record -g replay_slow_sentences --repeat=20
+//
+// Every captured forest is solved --repeat times, so that the profile is
+// dominated by the pathological forests rather than by reading the input.
+// Forests are captured as read, and simplified once before being solved with
+// --collapse_unary, --simplify_forest and --reorder_forest as in
+// find_expected_governor.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "command_line_flags.h"
+#include "expected_governor.h"
+#include "forest_io.h"
+#include "forest_reorder.h"
+#include "forest_simplifier.h"
+#include "grammar.h"
+#include "parse_forest.pb.h"
+
+#define rule_path "data/tcrf_rule"
+#define binary_headrules_path "data/binary_headrules"
+#define slow_sentence_path "data/slow_sentences"
+
+using namespace nlu;
+
+int main(int argc, char **argv) {
+  CommandLineFlags flags = parse_flags(argc, argv);
+  std::string input = flag_string(flags, "input", slow_sentence_path);
+  int repeat = flag_int(flags, "repeat", 1);
+  GovernorFinderOptions finder_options;
+  finder_options.num_threads = flag_int(flags, "bu_threads", 1);
+  bool collapse_unary = flag_bool(flags, "collapse_unary");
+  bool simplify_forest = flag_bool(flags, "simplify_forest");
+  bool reorder_forest = flag_bool(flags, "reorder_forest");
+
+  std::shared_ptr<const Grammar> grammar =
+      Grammar::Load(rule_path, binary_headrules_path);
+  if (!grammar) {
+    fprintf(stderr, "can not read %s or %s\n", rule_path,
+            binary_headrules_path);
+    return 1;
+  }
+
+  std::ifstream fin(input.c_str());
+  if (!fin) {
+    fprintf(stderr, "can not open %s\n", input.c_str());
+    return 1;
+  }
+  printf("record nodes edges basic_units max_cell_size min_ms avg_ms\n");
+  int record = 0;
+  while (true) {
+    ForestSentence fs;
+    if (!ReadForestSentence(fin, grammar->label_list(),
+                            grammar->binary_headrules(), &fs)) {
+      break;
+    }
+    if (fs.forest().nodes_size() == 0) {
+      record++;
+      continue;
+    }
+    if (collapse_unary) {
+      CollapseUnaryChains(fs.mutable_forest());
+    }
+    if (simplify_forest || collapse_unary) {
+      SimplifyForest(&fs);
+    }
+    if (reorder_forest) {
+      ReorderForest(&fs);
+    }
+    double min_ms = 0.0, total_ms = 0.0;
+    size_t max_cell_size = 0;
+    for (int r = 0; r < repeat; r++) {
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      GovernorFinder gf(&fs, finder_options);
+      double elapsed_ms = std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count();
+      if (r == 0 || elapsed_ms < min_ms) {
+        min_ms = elapsed_ms;
+      }
+      total_ms += elapsed_ms;
+      max_cell_size = gf.MaxCellSize();
+    }
+    printf("%d %d %d %d %zu %.3f %.3f\n", record, fs.forest().nodes_size(),
+           fs.forest().edges_size(), fs.basic_units_size(), max_cell_size,
+           min_ms, total_ms / std::max(repeat, 1));
+    record++;
+  }
+  fin.close();
+}
@@ -0,0 +1,252 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Expected governors of the top node estimated from sampled derivations.
+//
+// GovernorFinder weighs a derivation by the product of p(e|h) = merit / (sum
+// of the merits of the edges of h which have a derivation), so that the
+// inside score of every node with a derivation is 1, and derivations are
+// sampled exactly from this distribution top down, picking one edge of every
+// node by p(e|h). The governors of every sampled derivation are read off with
+// a DerivationGovernorReader. When the basic units overlap, a derivation
+// covers only some of them (and may reach a basic unit through several
+// leaves) and, as GovernorFinder normalizes every cell, the probability of a
+// markup of a basic unit is its share of the markups read for the basic
+// unit, with the binomial standard error sqrt(p (1 - p) / n) for n such
+// markups. Sampling and reading a derivation
+// reuse buffers sized for the forest once, resetting only the nodes of the
+// derivation, and the markups of a basic unit are counted through a hash
+// table, so that after a setup linear in the size of the forest the cost is
+// num_samples times the size of a derivation, whatever the ambiguity of the
+// forest.
+//
+// This converges to GovernorFinder on the forests where every derivation of
+// a node covers the same basic units (see EdgePosteriorGovernorFinder::exact).
+// On the others GovernorFinder normalizes the cells of a node over different
+// sets of edges, which no distribution over derivations reproduces.
+//
+
+#ifndef NLU_CRF_SAMPLED_GOVERNOR_H__
+#define NLU_CRF_SAMPLED_GOVERNOR_H__
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "best_derivation.h"
+#include "expected_governor.h"
+#include "governor_counts.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+struct SamplingOptions {
+  int num_samples;
+  // seed of the random generator, so that results are reproducible
+  uint64_t seed;
+
+  SamplingOptions() : num_samples(1000), seed(0) {}
+};
+
+class SampledGovernorFinder {
+ public:
+  SampledGovernorFinder(const ForestSentence* forestSentence,
+                        const SamplingOptions& options)
+    : fs(forestSentence), num_samples(std::max(options.num_samples, 1)),
+      generator(options.seed) {
+    result.resize(fs->basic_units_size());
+    sampled_markups.assign(fs->basic_units_size(), 0);
+    markup_index.resize(fs->basic_units_size());
+    for (int j = 0; j < fs->basic_units_size(); j++) {
+      result[j].idx = j;
+    }
+    const ParseForest& forest = fs->forest();
+    if (forest.nodes_size() == 0) {
+      return;
+    }
+    computeEdgeProbabilities();
+    if (!available[forest.nodes_size() - 1]) {
+      return;
+    }
+    std::vector<int> derivation_edge(forest.nodes_size(), -1);
+    DerivationGovernorReader reader(fs);
+    std::vector<std::pair<int, GovernorMarkup> > governors;
+    for (int s = 0; s < num_samples; s++) {
+      sampleDerivation(&derivation_edge);
+      reader.Read(derivation_edge, &governors);
+      for (size_t g = 0; g < governors.size(); g++) {
+        sampled_markups[governors[g].first]++;
+        addSample(governors[g].first, governors[g].second);
+      }
+    }
+    for (size_t j = 0; j < result.size(); j++) {
+      for (size_t k = 0; k < result[j].gms.size(); k++) {
+        result[j].gms[k].probability /= sampled_markups[j];
+      }
+    }
+  }
+
+  // estimated governors of every basic unit of the top node
+  const std::vector<GovernorsPerWord>& GetGovernors() const {
+    return result;
+  }
+
+  // standard error of the probability of every markup of GetGovernors()
+  std::vector<std::vector<double> > StandardErrors() const {
+    std::vector<std::vector<double> > errors(result.size());
+    for (size_t j = 0; j < result.size(); j++) {
+      for (size_t k = 0; k < result[j].gms.size(); k++) {
+        errors[j].push_back(standardError(j, k));
+      }
+    }
+    return errors;
+  }
+
+  // the largest standard error of a markup
+  double MaxStandardError() const {
+    double max_error = 0.0;
+    for (size_t j = 0; j < result.size(); j++) {
+      for (size_t k = 0; k < result[j].gms.size(); k++) {
+        max_error = std::max(max_error, standardError(j, k));
+      }
+    }
+    return max_error;
+  }
+
+ private:
+  // In the order GovernorFinder computes the nodes: whether every node has
+  // a derivation, and p(e|h) of the edges whose tails all have one. A tail
+  // after its head which is not a leaf is not computed yet at that time.
+  void computeEdgeProbabilities() {
+    const ParseForest& forest = fs->forest();
+    int num_of_nodes = forest.nodes_size();
+    is_leaf.assign(num_of_nodes, false);
+    available.assign(num_of_nodes, false);
+    edge_probability.assign(forest.edges_size(), 0.0);
+    for (int i = 0; i < num_of_nodes; i++) {
+      if (LeafBasicUnit(*fs, forest.nodes(i)) >= 0) {
+        is_leaf[i] = true;
+        available[i] = true;
+      }
+    }
+    for (int i = 0; i < num_of_nodes; i++) {
+      if (is_leaf[i]) {
+        continue;
+      }
+      double sum = 0.0;
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        bool productive = true;
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          int t = edge.tail_idx(k);
+          if (!available[t] || (t > i && !is_leaf[t])) {
+            productive = false;
+          }
+        }
+        if (productive && EdgeProbability(edge) > 0.0) {
+          edge_probability[j] = EdgeProbability(edge);
+          sum += edge_probability[j];
+        }
+      }
+      if (sum <= 0.0) {
+        continue;
+      }
+      available[i] = true;
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        edge_probability[j] /= sum;
+      }
+    }
+  }
+
+  // pick an edge of every node of a derivation of the top node, top down
+  void sampleDerivation(std::vector<int>* derivation_edge) {
+    const ParseForest& forest = fs->forest();
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<int> stack(1, forest.nodes_size() - 1);
+    // reset only the nodes of the previous sample
+    for (size_t n = 0; n < sampled_nodes.size(); n++) {
+      (*derivation_edge)[sampled_nodes[n]] = -1;
+    }
+    sampled_nodes.clear();
+    while (!stack.empty()) {
+      int i = stack.back();
+      stack.pop_back();
+      int begin = forest.starting_indexes(i);
+      int end = forest.starting_indexes(i+1);
+      // a leaf ends a derivation as in DerivationGovernorReader, even when
+      // its range holds edges of other heads
+      if (is_leaf[i] || (*derivation_edge)[i] >= 0) {
+        continue;
+      }
+      double r = uniform(generator);
+      int chosen = -1;
+      for (int j = begin; j < end; j++) {
+        if (edge_probability[j] <= 0.0) {
+          continue;
+        }
+        chosen = j;
+        r -= edge_probability[j];
+        if (r < 0.0) {
+          break;
+        }
+      }
+      (*derivation_edge)[i] = chosen;
+      sampled_nodes.push_back(i);
+      const HyperEdgeInfo& edge = forest.edges(chosen);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        stack.push_back(edge.tail_idx(k));
+      }
+    }
+  }
+
+  // count one sample of markup m for basic unit bu_idx
+  void addSample(int bu_idx, const GovernorMarkup& m) {
+    std::vector<GovernorMarkup>& gms = result[bu_idx].gms;
+    key.label_u = m.label_u;
+    key.label_parent_of_u = m.label_parent_of_u;
+    key.headword_parent_of_u = m.headword_parent_of_u;
+    std::pair<MarkupIndex::iterator, bool> inserted =
+        markup_index[bu_idx].insert(std::make_pair(key, gms.size()));
+    if (!inserted.second) {
+      gms[inserted.first->second].probability += 1.0;
+      return;
+    }
+    gms.push_back(m);
+    gms.back().probability = 1.0;
+  }
+
+  // standard error of markup k of basic unit j
+  double standardError(size_t j, size_t k) const {
+    double p = result[j].gms[k].probability;
+    return sqrt(std::max(0.0, p * (1.0 - p)) / sampled_markups[j]);
+  }
+
+  const ForestSentence* fs;
+  int num_samples;
+  std::mt19937_64 generator;
+  std::vector<bool> is_leaf;
+  std::vector<bool> available;
+  std::vector<double> edge_probability;
+  // number of markups read for every basic unit over all samples
+  std::vector<int> sampled_markups;
+  // nodes given an edge by the last sample
+  std::vector<int> sampled_nodes;
+  // index in result[j].gms of every markup of basic unit j
+  typedef std::unordered_map<GovernorCountKey, size_t, GovernorCountKeyHash>
+      MarkupIndex;
+  std::vector<MarkupIndex> markup_index;
+  GovernorCountKey key;
+  std::vector<GovernorsPerWord> result;
+};
+
+} // namespace nlu
+
+#endif
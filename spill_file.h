@@ -0,0 +1,96 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// An append-only scratch file for data evicted from memory, read back through
+// a memory mapping. The file is unlinked as soon as it is created, so it
+// disappears with the process.
+//
+
+#ifndef NLU_CRF_SPILL_FILE_H__
+#define NLU_CRF_SPILL_FILE_H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace nlu {
+
+class SpillFile {
+ public:
+  explicit SpillFile(const std::string& path)
+    : fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)), end(0),
+      mapped(NULL), mapped_size(0) {
+    if (fd >= 0) {
+      unlink(path.c_str());
+    }
+  }
+
+  ~SpillFile() {
+    unmap();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool is_open() const {
+    return fd >= 0;
+  }
+
+  // append data to the file, and return its offset, or -1 on failure
+  off_t Append(const std::string& data) {
+    off_t offset = end;
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = pwrite(fd, data.data() + written, data.size() - written,
+                         offset + written);
+      if (n <= 0) {
+        return -1;
+      }
+      written += n;
+    }
+    end += data.size();
+    return offset;
+  }
+
+  // The data at offset, valid until the next call to Data after an Append.
+  // The mapping covers the whole file and is only renewed when it grew.
+  const char* Data(off_t offset) {
+    if (mapped_size < static_cast<size_t>(end)) {
+      unmap();
+      void* p = mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        return NULL;
+      }
+      mapped = static_cast<const char*>(p);
+      mapped_size = end;
+    }
+    return mapped + offset;
+  }
+
+  // bytes written so far
+  off_t size() const {
+    return end;
+  }
+
+ private:
+  void unmap() {
+    if (mapped != NULL) {
+      munmap(const_cast<char*>(mapped), mapped_size);
+      mapped = NULL;
+      mapped_size = 0;
+    }
+  }
+
+  int fd;
+  off_t end;
+  const char* mapped;
+  size_t mapped_size;
+};
+
+} // namespace nlu
+
+#endif
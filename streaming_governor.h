@@ -0,0 +1,344 @@
+// Copyright MISingularity.io
+// All right reserved.
+
+//
+// Expected governors computed while a sentence is read from the prediction
+// file, by the per-node step of a deferred GovernorFinder, overlapping the
+// propagation with reading and parsing the input, and keeping only the rows
+// of the chart which may still be read.
+//
+// The nodes are read before the edges, and GovernorFinder computes node i
+// from the edges in [starting_indexes(i), starting_indexes(i+1)), which only
+// grows at its end while the edges are read. The edges come grouped by the
+// span of their head rather than by head: an edge listed after the edges of
+// a later head of the same span falls in the range being read, shifting the
+// ranges after it (see AddStartingIndexes), and sets the headword of its
+// head, which GovernorFinder only uses once every edge is read. Node i is
+// thus computed once its range is read and an edge of a head after the run
+// of nodes with its span is read, when its headword and the ones of its
+// tails are final.
+//
+// The tails of an edge splitting the span of its head start or end where the
+// head does. The row of a node is freed once the runs of every node which
+// may read it this way are read, and every edge read with it as a tail is
+// computed.
+//
+// Input breaking these assumptions is still computed exactly: when an edge
+// changes the headword of a node used already, that node and the computed
+// nodes reading it are computed again, as UpdateEdgeMerits does, and the
+// sentence is computed again from scratch by GovernorFinder once read if
+// this or a node reads a freed row, or if a node to compute again reads a
+// later node computed already. The edges are kept in the forest for that.
+//
+
+#ifndef NLU_CRF_STREAMING_GOVERNOR_H__
+#define NLU_CRF_STREAMING_GOVERNOR_H__
+
+#include <algorithm>
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "expected_governor.h"
+#include "forest_io.h"
+#include "parse_forest.pb.h"
+
+namespace nlu {
+
+template <class Semiring>
+class StreamingGovernorFinderT {
+ public:
+  explicit StreamingGovernorFinderT(ForestSentence* forestSentence)
+    : fs(forestSentence), next_node(0), max_head(-1), recomputed(false) {}
+
+  // Read the next sentence from fin into the (empty) forest sentence and
+  // compute its governors. Return false at the end of the input.
+  bool Read(std::istream& fin, const std::vector<std::string>& label_list,
+            const std::map<std::string, int>& binary_headrules) {
+    bool parsed;
+    if (!ReadForestNodes(fin, fs, &parsed)) {
+      return false;
+    }
+    if (!parsed) {
+      return true;
+    }
+    ParseForest* forest = fs->mutable_forest();
+    int num_of_nodes = forest->nodes_size();
+    GovernorFinderOptions options;
+    options.deferred = true;
+    finder.reset(new GovernorFinderT<Semiring>(fs, options));
+    computeSpanRuns();
+    last_tail_edge.assign(num_of_nodes, -1);
+    released_after.assign(num_of_nodes, std::vector<int>());
+    released.assign(num_of_nodes, false);
+    readers.assign(num_of_nodes, std::vector<int>());
+    headword_used.assign(num_of_nodes, false);
+    used_headwords.assign(num_of_nodes, std::make_pair(-1, -1));
+
+    int last_head = -1;
+    int num_of_edges = ReadForestEdgeCount(fin);
+    for (int i = 0; i < num_of_edges; i++) {
+      HyperEdgeInfo* edge = forest->add_edges();
+      ReadForestEdge(fin, label_list, binary_headrules, forest, edge);
+      int head = edge->head_idx();
+      AddStartingIndexes(head, i, &last_head, forest);
+      if (recomputed) {
+        continue;
+      }
+      for (int k = 0; k < edge->tail_idx_size(); k++) {
+        last_tail_edge[edge->tail_idx(k)] = i;
+      }
+      const NodeInfo& node = forest->nodes(head);
+      if (headword_used[head]
+          && used_headwords[head] != std::make_pair(node.headword_stt(),
+                                                    node.headword_end())) {
+        recomputeHeadword(head);
+      }
+      for (; max_head < head; max_head++) {
+        if (max_head >= 0) {
+          scheduleReleases(max_head);
+        }
+      }
+      // ungrouped edges add starting indexes past the last node
+      while (!recomputed && next_node < num_of_nodes
+             && next_node + 1 < forest->starting_indexes_size()
+             && run_end[next_node] < max_head) {
+        computeNextNode();
+      }
+    }
+    forest->add_starting_indexes(num_of_edges);
+    // as GovernorFinder, every node is computed, whatever edges it has
+    while (!recomputed && next_node < num_of_nodes) {
+      computeNextNode();
+    }
+    if (recomputed) {
+      finder.reset(new GovernorFinderT<Semiring>(fs));
+    }
+    return true;
+  }
+
+  // governors of every basic unit of the top node
+  std::vector<GovernorsPerWord> GetGovernors() const {
+    if (!finder) {
+      return std::vector<GovernorsPerWord>(fs->basic_units_size());
+    }
+    return finder->GetTopGovernors();
+  }
+
+  // whether the sentence could not be streamed and was computed again by
+  // GovernorFinder
+  bool Recomputed() const {
+    return recomputed;
+  }
+
+ private:
+  // compute node next_node with the per-node step of GovernorFinder, and
+  // free the rows no later node reads; give up streaming if one of its tails
+  // was freed
+  void computeNextNode() {
+    const ParseForest& forest = fs->forest();
+    int i = next_node;
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        if (released[edge.tail_idx(k)]) {
+          recomputed = true;
+          return;
+        }
+      }
+    }
+    useHeadword(i);
+    for (int j = forest.starting_indexes(i);
+         j < forest.starting_indexes(i+1); j++) {
+      const HyperEdgeInfo& edge = forest.edges(j);
+      for (int k = 0; k < edge.tail_idx_size(); k++) {
+        int t = edge.tail_idx(k);
+        if (readers[t].empty() || readers[t].back() != i) {
+          readers[t].push_back(i);
+        }
+        // a node after i holds no markups yet, but for a leaf
+        if (t > i && isLeaf(t)) {
+          useHeadword(t);
+        }
+      }
+    }
+    finder->computeNode(i, 0, fs->basic_units_size());
+    next_node++;
+    for (size_t r = 0; r < released_after[i].size(); r++) {
+      release(released_after[i][r]);
+    }
+  }
+
+  // Compute again the nodes which used the previous headword of node h: h if
+  // it is computed, and the computed nodes reading them. Give up streaming
+  // if one of them was freed, or reads a freed row or a later node which is
+  // computed already and not computed again.
+  void recomputeHeadword(int h) {
+    const ParseForest& forest = fs->forest();
+    std::vector<bool> affected(forest.nodes_size(), false);
+    if (h < next_node) {
+      affected[h] = true;
+    }
+    for (size_t r = 0; r < readers[h].size(); r++) {
+      affected[readers[h][r]] = true;
+    }
+    std::vector<int> nodes;
+    for (int i = 0; i < next_node; i++) {
+      if (!affected[i]) {
+        continue;
+      }
+      nodes.push_back(i);
+      for (size_t r = 0; r < readers[i].size(); r++) {
+        affected[readers[i][r]] = true;
+      }
+    }
+    for (size_t n = 0; n < nodes.size(); n++) {
+      int i = nodes[n];
+      if (released[i]) {
+        recomputed = true;
+        return;
+      }
+      for (int j = forest.starting_indexes(i);
+           j < forest.starting_indexes(i+1); j++) {
+        const HyperEdgeInfo& edge = forest.edges(j);
+        for (int k = 0; k < edge.tail_idx_size(); k++) {
+          int t = edge.tail_idx(k);
+          if (released[t]
+              || (t > i && t < next_node && !affected[t] && !isLeaf(t))) {
+            recomputed = true;
+            return;
+          }
+        }
+      }
+    }
+    useHeadword(h);
+    finder->RecomputeNodes(nodes);
+  }
+
+  // Once an edge of a head after h is read, every edge of the heads up to h
+  // is read: free the rows of the nodes which only these may read, as soon
+  // as the nodes computing the edges read with them as a tail are computed.
+  void scheduleReleases(int h) {
+    const ParseForest& forest = fs->forest();
+    for (size_t r = 0; r < last_heads[h].size(); r++) {
+      int t = last_heads[h][r];
+      int last_reader = t;
+      if (last_tail_edge[t] >= 0) {
+        // the node whose range of edges holds the edge
+        int owner = std::upper_bound(forest.starting_indexes().begin(),
+                                     forest.starting_indexes().end(),
+                                     last_tail_edge[t])
+                    - forest.starting_indexes().begin() - 1;
+        last_reader = std::max(last_reader, owner);
+      }
+      if (last_reader < next_node) {
+        release(t);
+      } else if (last_reader < forest.nodes_size() - 1) {
+        released_after[last_reader].push_back(t);
+      }
+    }
+  }
+
+  void release(int i) {
+    finder->ReleaseRow(i);
+    released[i] = true;
+  }
+
+  bool isLeaf(int i) const {
+    const NodeInfo& node = fs->forest().nodes(i);
+    return node.basic_unit() == 1 && node.upper() == 0;
+  }
+
+  // record the headword of node i, which the result now depends on
+  void useHeadword(int i) {
+    const NodeInfo& node = fs->forest().nodes(i);
+    headword_used[i] = true;
+    used_headwords[i] = std::make_pair(node.headword_stt(),
+                                       node.headword_end());
+  }
+
+  // The run of nodes with the span of every node, and the last head which
+  // may read every node: the end of the run of the last node containing its
+  // span and sharing its start or its end. The top node, and nodes whose
+  // span is not within the tokens, are never freed.
+  void computeSpanRuns() {
+    const ParseForest& forest = fs->forest();
+    int num_of_nodes = forest.nodes_size();
+    run_end.resize(num_of_nodes);
+    for (int i = num_of_nodes - 1; i >= 0; i--) {
+      const NodeInfo& node = forest.nodes(i);
+      bool same_span = i + 1 < num_of_nodes
+                       && forest.nodes(i + 1).start() == node.start()
+                       && forest.nodes(i + 1).end() == node.end();
+      run_end[i] = same_span ? run_end[i + 1] : i;
+    }
+
+    int size = fs->tokens_size() + 1;
+    // from_start[s * size + e]: the last node starting at s and ending at e
+    // or after, to_end[e * size + s]: the last node ending at e and starting
+    // at s or before
+    std::vector<int> from_start(size * size, -1), to_end(size * size, -1);
+    for (int i = 0; i < num_of_nodes; i++) {
+      int s = forest.nodes(i).start(), e = forest.nodes(i).end();
+      if (s < 0 || e < s || e >= size) {
+        continue;
+      }
+      from_start[s * size + e] = i;
+      to_end[e * size + s] = i;
+    }
+    for (int s = 0; s < size; s++) {
+      for (int e = size - 2; e >= 0; e--) {
+        from_start[s * size + e] = std::max(from_start[s * size + e],
+                                            from_start[s * size + e + 1]);
+      }
+    }
+    for (int e = 0; e < size; e++) {
+      for (int s = 1; s < size; s++) {
+        to_end[e * size + s] = std::max(to_end[e * size + s],
+                                        to_end[e * size + s - 1]);
+      }
+    }
+    last_heads.assign(num_of_nodes, std::vector<int>());
+    for (int i = 0; i < num_of_nodes - 1; i++) {
+      int s = forest.nodes(i).start(), e = forest.nodes(i).end();
+      if (s < 0 || e < s || e >= size) {
+        continue;
+      }
+      int last_head = std::max(i, std::max(from_start[s * size + e],
+                                           to_end[e * size + s]));
+      last_heads[run_end[last_head]].push_back(i);
+    }
+  }
+
+  ForestSentence* fs;
+  std::unique_ptr<GovernorFinderT<Semiring> > finder;
+  // the next node to compute
+  int next_node;
+  // the largest head of the edges read so far
+  int max_head;
+  bool recomputed;
+  // last node of the run of nodes with the span of a node, by node
+  std::vector<int> run_end;
+  // nodes which only the heads up to a node may read, by node
+  std::vector<std::vector<int> > last_heads;
+  // the last edge read with a node as a tail, by node
+  std::vector<int> last_tail_edge;
+  // nodes whose row is freed once a node is computed, by node
+  std::vector<std::vector<int> > released_after;
+  std::vector<bool> released;
+  // computed nodes reading a node, by node
+  std::vector<std::vector<int> > readers;
+  // the headword of a node when the result started to depend on it
+  std::vector<bool> headword_used;
+  std::vector<std::pair<int, int> > used_headwords;
+};
+
+typedef StreamingGovernorFinderT<ProbabilitySemiring> StreamingGovernorFinder;
+
+} // namespace nlu
+
+#endif